@@ -35,154 +35,4963 @@
 // }
 //
 
+#ifdef __cplusplus
+// Before the macros, which would break them
+# include <iterator>
+# include <utility>
+#endif
+
 #define _test_concat1(_0, _1) _0##_1
 #define _test_concat(_0, _1) _test_concat1(_0, _1)
 
+// Defines the next _test_t slot. C++ has no tentative definitions to fill the
+// slots in with, so there each one registers itself instead.
+#ifdef __cplusplus
+# define _test_define(...) _test_define1(__COUNTER__, __VA_ARGS__)
+# define _test_define1(_n, ...)                                                \
+	_Pragma("GCC diagnostic push");                                        \
+	_Pragma("GCC diagnostic ignored \"-Wmissing-field-initializers\"");   \
+	static _test_t _test_concat(_test, _n) = {__VA_ARGS__};                \
+	_Pragma("GCC diagnostic pop");                                         \
+	static const _test_registrar _test_concat(_test_registrar, _n)(        \
+		&_test_concat(_test, _n))
+#else
+# define _test_define(...)                                                     \
+	_test_t _test_concat(_test, __COUNTER__) = {__VA_ARGS__}
+#endif
+
 #define test(_name)                                                            \
 	static int test_##_name(void);                                         \
-	_test_t _test_concat(_test, __COUNTER__) = {                           \
-		.testfn = test_##_name, .istest = true, .name = #_name};       \
+	_test_define(                                                          \
+		.testfn = test_##_name, .name = #_name, .kind = _TEST_TEST);   \
+	static int test_##_name(void)
+
+// Expensive state shared by tests, like a loaded index. The fixture body runs
+// once, in a child process, and can assert like a test. Every test_in(fixture,
+// name) then runs in a fork of that child, so it starts from a pristine
+// copy-on-write snapshot of whatever the fixture set up.
+#define fixture(_name)                                                         \
+	static int fixture_##_name(void);                                      \
+	_test_define(.testfn = fixture_##_name,                                \
+		     .name = #_name,                                           \
+		     .kind = _TEST_FIXTURE);                                   \
+	static int fixture_##_name(void)
+#define test_in(_fixture, _name)                                               \
+	static int test_##_name(void);                                         \
+	_test_define(.testfn = test_##_name,                                   \
+		     .name = #_name,                                           \
+		     .fixture = #_fixture,                                     \
+		     .kind = _TEST_TEST);                                      \
 	static int test_##_name(void)
 
+// Runs the body once for every element of _array, i pointing to it, like
+// bench_on. test_on_parallel runs the cases on many threads, for bodies that
+// are thread safe.
+#define test_on(_name, _array) _test_on(_name, _array, false)
+#define test_on_parallel(_name, _array) _test_on(_name, _array, true)
+#define _test_on(_name, _array, _parallel)                                     \
+	static int test_##_name(__typeof__((_array)[0]) *const);               \
+	_test_define(.cases =                                                  \
+			     {                                                 \
+				     .fn = (_test_case_fn *)test_##_name,      \
+				     .array = (void *)(_array),                \
+				     .step = sizeof((_array)[0]),              \
+				     .nitems = sizeof(_array)                  \
+					     / sizeof((_array)[0]),            \
+				     .parallel = _parallel,                    \
+			     },                                                \
+		     .name = #_name,                                           \
+		     .kind = _TEST_CASES);                                     \
+	static int test_##_name(__typeof__((_array)[0]) *const i)
+
 #define bench_for(_name, _times)                                               \
 	static void bench_##_name(void *);                                     \
-	_test_t _test_concat(_test, __COUNTER__) = {                           \
-		.bench =                                                       \
-			{                                                      \
-				.fn = bench_##_name,                           \
-				.iters = _times,                               \
-				.nitems = 1,                                   \
-				},                                                     \
-		.name = #_name \
-	      };                                               \
+	_test_define(.bench =                                                  \
+			     {                                                 \
+				     .fn = bench_##_name,                      \
+				     .nitems = 1,                              \
+				     .iters = _times,                          \
+			     },                                                \
+		     .name = #_name);                                          \
 	static void bench_##_name(void *_______)
 #define bench_on(_name, _array, _times)                                        \
-	static void bench_##_name(typeof((_array)[0]) *const);                 \
-	_test_t _test_concat(_test, __COUNTER__) = {                           \
-		.bench =                                                       \
-			{                                                      \
-				.fn = (_test_bench_fn *)bench_##_name,         \
-				.array = _array,                               \
-				.step = sizeof((_array)[0]),                   \
-				.nitems =                                      \
-					sizeof(_array) / sizeof((_array)[0]),  \
-				.iters = _times,                               \
-				},                                                     \
-		.name = #_name \
-	      };                                               \
-	static void bench_##_name(typeof((_array)[0]) *const i)
+	bench_on_order(_name, _array, _times, TEST_ORDER_SEQUENTIAL)
+
+// Like bench_on, but visiting the array in another order so the prefetcher
+// and branch predictors can't learn it: TEST_ORDER_SHUFFLE (a new random
+// permutation every iteration), TEST_ORDER_REVERSE or TEST_ORDER_STRIDE(k)
+// (every kth element, then every kth from the second one and so on). The
+// indices are computed before each sample starts timing.
+#define bench_on_order(_name, _array, _times, _order)                          \
+	static void bench_##_name(__typeof__((_array)[0]) *const);             \
+	_test_define(.bench =                                                  \
+			     {                                                 \
+				     .fn = (_test_bench_fn *)bench_##_name,    \
+				     .array = (void *)(_array),                \
+				     .step = sizeof((_array)[0]),              \
+				     .nitems = sizeof(_array)                  \
+					     / sizeof((_array)[0]),            \
+				     .iters = _times,                          \
+				     .order = _order,                          \
+			     },                                                \
+		     .name = #_name);                                          \
+	static void bench_##_name(__typeof__((_array)[0]) *const i)
+
+// Like bench_on, but over _len elements of _type filled in by calling
+// _fill(array, len) once before the benchmark runs. _len can be any
+// expression, it is evaluated at runtime.
+#define bench_gen(_name, _type, _len, _fill, _times)                           \
+	static void bench_##_name(_type *const);                               \
+	static size_t bench_##_name##_nitems(void) { return _len; }            \
+	static void bench_##_name##_gen(void *array, size_t nitems) {          \
+		_fill((_type *)array, nitems);                                 \
+	}                                                                      \
+	_test_define(.bench =                                                  \
+			     {                                                 \
+				     .fn = (_test_bench_fn *)bench_##_name,    \
+				     .step = sizeof(_type),                    \
+				     .iters = _times,                          \
+				     .prepare = _test_gen_prepare,             \
+				     .release = _test_gen_release,             \
+				     .gen = bench_##_name##_gen,               \
+				     .count = bench_##_name##_nitems,          \
+			     },                                                \
+		     .name = #_name);                                          \
+	static void bench_##_name(_type *const i)
 
+// Benchmarks over the records of a file, which is mmapped instead of read so
+// i->data points straight into the page cache. _format is one of TEST_LINES,
+// TEST_LEN32 (4 byte little endian length prefix) or TEST_FIXED(size), and
+// can be or'ed with TEST_POPULATE to fault the whole file in before timing.
+#define bench_corpus(_name, _path, _format, _times)                            \
+	static void bench_##_name(const test_record_t *const);                 \
+	_test_define(.bench =                                                  \
+			     {                                                 \
+				     .fn = (_test_bench_fn *)bench_##_name,    \
+				     .step = sizeof(test_record_t),            \
+				     .iters = _times,                          \
+				     .prepare = _test_corpus_prepare,          \
+				     .release = _test_corpus_release,          \
+				     .path = _path,                            \
+				     .format = _format,                        \
+			     },                                                \
+		     .name = #_name);                                          \
+	static void bench_##_name(const test_record_t *const i)
+
+// Benchmarks code reading a file, like a log reader or an index loader. A
+// _size byte file of random data is written to $TMPDIR (/var/tmp by default)
+// and the body gets it as i, with an open fd to pread from. Registered twice,
+// as name/cold, with the file evicted from the page cache before every
+// iteration (each one is a sample of its own, timed after evicting), and
+// name/warm, with it read once up front. _flags can be
+// TEST_DIRECT to open it O_DIRECT where the filesystem allows, in which case
+// reads need to be aligned to i->align. Reports the bytes read and read calls
+// made, from /proc/self/io.
+#define bench_file(_name, _size, _flags, _times)                               \
+	static void bench_##_name(const test_file_t *const);                   \
+	_test_define(.bench =                                                  \
+			     {                                                 \
+				     .fn = (_test_bench_fn *)bench_##_name,    \
+				     .step = sizeof(test_file_t),              \
+				     .iters = _times,                          \
+				     .prepare = _test_file_prepare,            \
+				     .release = _test_file_release,            \
+				     .filesize = _size,                        \
+				     .fileflags = _flags,                      \
+			     },                                                \
+		     .name = #_name);                                          \
+	static void bench_##_name(const test_file_t *const i)
+
+// Benchmarks handing items from one thread to another, with the body running
+// on both. The producer side (producer is true) runs pinned to core _producer
+// and each call should hand one item over, the consumer side runs on core
+// _consumer and each call should wait for and take one. A core of -1 leaves
+// that thread unpinned. Measures one-way and round trip latency and the time
+// per item when streaming _times items.
+#define bench_pair(_name, _times, _producer, _consumer)                        \
+	static void bench_##_name(bool);                                       \
+	_test_define(.pair =                                                   \
+			     {                                                 \
+				     .fn = bench_##_name,                      \
+				     .iters = _times,                          \
+				     .cores = {_producer, _consumer},          \
+			     },                                                \
+		     .name = #_name,                                           \
+		     .kind = _TEST_PAIR);                                      \
+	static void bench_##_name(const bool producer)
+
+// Like bench_on, but the body gets a pointer i to a chunk of n elements
+// instead of one element at a time. Runs once for every chunk size given, as
+// name/size, and reports time per element.
+#define bench_batch(_name, _array, _times, ...)                                \
+	static void bench_##_name(__typeof__((_array)[0]) *const, size_t);     \
+	static const size_t bench_##_name##_chunks[] = {__VA_ARGS__, 0};       \
+	_test_define(.bench =                                                  \
+			     {                                                 \
+				     .array = (void *)(_array),                \
+				     .step = sizeof((_array)[0]),              \
+				     .nitems = sizeof(_array)                  \
+					     / sizeof((_array)[0]),            \
+				     .iters = _times,                          \
+				     .batch = (_test_batch_fn *)bench_##_name, \
+				     .chunks = bench_##_name##_chunks,         \
+			     },                                                \
+		     .name = #_name);                                          \
+	static void bench_##_name(                                             \
+		__typeof__((_array)[0]) *const i, const size_t n)
+
+// Fuzz target, the body gets the input in data and size and can use assert
+// like a test
+#define fuzz(_name)                                                            \
+	static int fuzz_##_name(const uint8_t *, size_t);                      \
+	_test_define(                                                          \
+		.fuzzfn = fuzz_##_name, .name = #_name, .kind = _TEST_FUZZ);   \
+	static int fuzz_##_name(const uint8_t *data, size_t size)
+
+// Measures the benchmarks interleaved with each other and prints how much
+// faster each one is than the first (the baseline)
+#define bench_group(_name, _baseline, ...)                                     \
+	_test_define(.group = #_baseline "," #__VA_ARGS__,                     \
+		     .name = #_name,                                           \
+		     .kind = _TEST_GROUP)
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/vfs.h>
+
+#ifdef __cplusplus
+# define _TEST_C extern "C"
+# define _TEST_NOEXCEPT noexcept
+#else
+# define _TEST_C
+# define _TEST_NOEXCEPT
+#endif
+
+#ifndef TEST_SAMPLES
+# define TEST_SAMPLES 30
+#endif
+
+#ifndef TEST_COUNTERS
+# define TEST_COUNTERS 8
+#endif
+
+#ifndef TEST_PROFILE_HZ
+# define TEST_PROFILE_HZ 1000
+#endif
+
+#define TEST_LINES 1
+#define TEST_LEN32 2
+#define TEST_FIXED(_size) (3 | (size_t)(_size) << 8)
+#define TEST_POPULATE 4
+
+// Flags for bench_file
+#define TEST_DIRECT 1
+
+// Page sizes for bench_alloc and --pages
+#define TEST_PAGES_SMALL 0
+#define TEST_PAGES_HUGE 1
+#define TEST_PAGES_HUGETLB 2
+
+// Access orders for bench_on_order
+#define TEST_ORDER_SEQUENTIAL 0
+#define TEST_ORDER_SHUFFLE 1
+#define TEST_ORDER_REVERSE 2
+#define TEST_ORDER_STRIDE(_k) (3 | (size_t)(_k) << 8)
 
 #define pass return 0
 #define fail return __LINE__
 #define assert(_cond, ...)                                                     \
 	if (!(_cond)) {                                                        \
-		printf(" Assertion failed: " __VA_ARGS__);                     \
-		printf("\n");                                                  \
+		_test_msgf("Assertion failed: " __VA_ARGS__);                  \
+		fail;                                                          \
+	}
+
+// Performance assertions. These run the named benchmark (once) if it hasn't
+// been run yet and only fail when the 95% confidence interval of its median
+// is entirely on the wrong side of the limit.
+#define _test_assert_perf(_cond, ...)                                          \
+	if (!(_cond)) {                                                        \
+		_test_msgf(" " __VA_ARGS__);                                   \
 		fail;                                                          \
 	}
+#define assert_bench_below(_bench, _ns, ...)                                   \
+	_test_assert_perf(_test_bench_below(#_bench, _ns), __VA_ARGS__)
+#define assert_bench_faster(_fast, _slow, _factor, ...)                        \
+	_test_assert_perf(                                                     \
+		_test_bench_faster(#_fast, #_slow, _factor), __VA_ARGS__)
+#define assert_bench_no_allocs(_bench, ...)                                    \
+	_test_assert_perf(_test_bench_no_allocs(#_bench), __VA_ARGS__)
 
+struct _test;
 typedef int(_test_fn)(void);
+typedef int(_test_fuzz_fn)(const uint8_t *, size_t);
 typedef void(_test_bench_fn)(void *);
+typedef void(_test_batch_fn)(void *, size_t);
+typedef bool(_test_prepare_fn)(struct _test *);
+typedef void(_test_release_fn)(struct _test *);
+typedef void(_test_gen_fn)(void *, size_t);
+typedef void(_test_pair_fn)(bool);
+typedef int(_test_case_fn)(void *);
+
+typedef struct test_record {
+	const void *data;
+	size_t len;
+} test_record_t;
+
+typedef struct test_file {
+	const char *path;
+	int fd;
+	size_t size, align;
+} test_file_t;
 
 typedef struct _test_bench {
 	_test_bench_fn *fn;
 	void *array;
 	size_t step, nitems, iters;
+
+	// Order to visit array in, and the indices to do that for nperms
+	// iterations in a row when it isn't sequential
+	size_t order;
+	size_t *indices, nperms;
+
+	// Batch benchmarks get chunk items at a time, one benchmark is
+	// registered for each of the (0 terminated) chunks
+	_test_batch_fn *batch;
+	size_t chunk;
+	const size_t *chunks;
+
+	// Sets up array and nitems before the benchmark runs (false to skip
+	// it) and cleans them up after
+	_test_prepare_fn *prepare;
+	_test_release_fn *release;
+	_test_gen_fn *gen;
+	size_t (*count)(void);
+	const char *path;
+	size_t format, mapsize;
+	void *map;
+
+	// bench_file's size and flags, and whether samples start with the file
+	// evicted from the page cache
+	size_t filesize, fileflags;
+	bool cold;
+
+	// Hash of the start of a generated dataset, which is freed before
+	// groups are reported but tells whether members ran over the same one
+	uint64_t input;
+
+	// Runs iters rounds of the benchmark itself and returns how long they
+	// took, for C++ bodies that need to be inlined into their loop
+	uint64_t (*sample)(struct _test_bench *, size_t);
+	void *ctx;
+
+	// What array was backed by, if it came from bench_alloc asking for
+	// huge pages, and how many bytes of it actually were
+	char backing[64];
+	size_t huge;
 } _test_bench_t;
 
+typedef struct _test_stats {
+	// Times are in nanoseconds per iteration
+	double mean, median, lo, hi, min, max;
+	double allocs;
+	size_t nsamples, iters;
+} _test_stats_t;
+
+typedef struct _test_pair {
+	_test_pair_fn *fn;
+	size_t iters;
+	int cores[2];
+
+	// One-way latency is in the test's stats
+	_test_stats_t rtt;
+	double oneway_p99, rtt_p99, item_ns;
+} _test_pair_t;
+
+typedef struct _test_cases {
+	_test_case_fn *fn;
+	void *array;
+	size_t step, nitems;
+	bool parallel;
+} _test_cases_t;
+
+typedef enum _test_kind {
+	_TEST_BENCH,
+	_TEST_TEST,
+	_TEST_GROUP,
+	_TEST_FUZZ,
+	_TEST_PAIR,
+	_TEST_CASES,
+	_TEST_FIXTURE,
+} _test_kind_t;
+
 typedef struct _test {
 	union {
 		_test_fn *testfn;
+		_test_fuzz_fn *fuzzfn;
 		_test_bench_t bench;
+		_test_pair_t pair;
+		_test_cases_t cases;
+		const char *group;
 	};
-	const char *name;
-	bool istest;
+	const char *name, *skip;
+
+	// Name of the fixture whose fork server runs the test, for test_in
+	const char *fixture;
+	_test_kind_t kind;
+	bool measured;
+
+	// Tests with state, from C++
+	int (*call)(struct _test *);
+	void *ctx;
+	_test_stats_t stats;
+	double *samples;
+
+	// Outcome and duration of the test's last run, kept in the result cache
+	bool cached, failed;
+	double secs;
+
+	// Most the scratch arena held during the test or a benchmark sample
+	size_t arena_peak;
+
+	// Counters from bench_count, summed over all samples
+	struct {
+		const char *name;
+		double total;
+	} counters[TEST_COUNTERS];
+	int ncounters;
 } _test_t;
 
+typedef struct _test_result {
+	const _test_t *test;
+	int line;
+	const char *msg;
+	double secs;
+} _test_result_t;
+
+typedef struct _test_machine {
+	// Working set sizes and load latency for L1, L2, L3 and memory
+	size_t sizes[4];
+	double latency[4];
+	// Read bandwidth in GB/s
+	double bw_single, bw_all;
+	double timer_ns, timer_res_ns;
+	int ncpus;
+	bool measured;
+} _test_machine_t;
+
+// Receives the results of a run. Any of the events can be NULL.
+struct _test_state;
+typedef struct _test_reporter _test_reporter_t;
+struct _test_reporter {
+	void (*start)(_test_reporter_t *, const struct _test_state *);
+	void (*result)(_test_reporter_t *, const _test_result_t *);
+	void (*bench)(_test_reporter_t *, const _test_t *);
+	void (*group)(_test_reporter_t *, const _test_t *, _test_t **, int);
+	void (*machine)(_test_reporter_t *, const _test_machine_t *);
+	void (*end)(_test_reporter_t *, const struct _test_state *);
+
+	// JUnit needs the totals before the test cases, so it keeps them (and
+	// the properties) in memory until the end
+	FILE *out, *cases, *props;
+	char *cases_buf, *props_buf;
+	size_t cases_len, props_len, n;
+};
+
 typedef struct _test_state {
-	_test_t *benches[1024];
-	int passed, ran, nbenches;
+	_test_t *tests[1024], *benches[1024], *fixtures[64], *current;
+	int passed, ran, ntests, nbenches, nfixtures;
+
+	// How many of the tests this run runs, less than ntests with
+	// --only-failed
+	int nrun;
+	_test_reporter_t reporters[4];
+	int nreporters;
+	const char *progname;
+	uint64_t start;
+	_test_machine_t machine;
+
+	// Options
+	const char *fuzz, *corpus, *profile, *perf_ctl, *cache, *stress;
+	const char *history, *history_report, *compare;
+	bool characterize, shuffle, failed_first, only_failed, fastest_first;
+	bool arena_poison;
+	double fuzz_time, stress_time;
+	int jobs, pages, layouts;
+	int worker; // --worker socket, -1 if not a worker
+	size_t max_len, stress_count;
+	uint64_t seed, rng;
 } _test_state_t;
 
-static void _test_run_bench(const char *name, _test_bench_t *bench) {
-	clock_t start = clock();
-	const uintptr_t array_end =
-		(uintptr_t)bench->array + bench->nitems * bench->step;
-	for (size_t i = 0; i < bench->iters; i++) {
-		for (uintptr_t addr = (uintptr_t)bench->array; addr < array_end;
-		     addr += bench->step) {
+static _test_state_t *_test_state;
+
+#ifdef __cplusplus
+// Filled in by the registrars _test_define leaves next to every test
+static _test_t *_test_registry[1024];
+static int _test_nregistered;
+
+struct _test_registrar {
+	explicit _test_registrar(_test_t *test) {
+		if (_test_nregistered < 1024) {
+			_test_registry[_test_nregistered++] = test;
+		}
+	}
+};
+#endif
+
+// Why the running test failed
+static __thread char _test_msg[1024];
+static __thread size_t _test_msglen;
+
+__attribute__((format(printf, 1, 2))) static void _test_msgf(
+	const char *fmt, ...) {
+	const size_t left = sizeof(_test_msg) - _test_msglen;
+	va_list args;
+	va_start(args, fmt);
+	const int len = vsnprintf(_test_msg + _test_msglen, left, fmt, args);
+	va_end(args);
+	if (len <= 0) return;
+	_test_msglen += (size_t)len < left ? (size_t)len : left - 1;
+}
+
+// Scratch arena for test and benchmark bodies. Allocating is bumping a
+// pointer and everything is freed at once after each test and each benchmark
+// sample, so big temporary structures cost next to nothing to build. Each
+// thread has its own, and --arena-poison overwrites freed memory so anything
+// still using it shows up.
+#ifndef TEST_ARENA_SIZE
+# define TEST_ARENA_SIZE ((size_t)1 << 30)
+#endif
+
+static __thread struct {
+	uint8_t *base;
+	size_t used, peak;
+} _test_arena;
+
+// Unmaps the arenas of threads as they exit
+static pthread_key_t _test_arena_key;
+static pthread_once_t _test_arena_once = PTHREAD_ONCE_INIT;
+
+static void _test_arena_unmap(void *base) {
+	munmap(base, TEST_ARENA_SIZE);
+}
+
+static void _test_arena_key_create(void) {
+	pthread_key_create(&_test_arena_key, _test_arena_unmap);
+}
+
+// Returns size bytes aligned to 16, or NULL once TEST_ARENA_SIZE is used up
+static inline void *test_arena_alloc(size_t size) {
+	if (!_test_arena.base) {
+		void *base = mmap(NULL,
+				  TEST_ARENA_SIZE,
+				  PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				  -1,
+				  0);
+		if (base == MAP_FAILED) return NULL;
+		_test_arena.base = (uint8_t *)base;
+		pthread_once(&_test_arena_once, _test_arena_key_create);
+		pthread_setspecific(_test_arena_key, base);
+	}
+	const size_t at = (_test_arena.used + 15) & ~(size_t)15;
+	if (at > TEST_ARENA_SIZE || size > TEST_ARENA_SIZE - at) return NULL;
+	_test_arena.used = at + size;
+	if (_test_arena.used > _test_arena.peak) {
+		_test_arena.peak = _test_arena.used;
+	}
+	return _test_arena.base + at;
+}
+
+// Frees what was allocated since the arena held mark bytes and returns the
+// most it held above that. Benchmark samples only free their own allocations
+// so a test running a benchmark keeps its own.
+static size_t _test_arena_rewind(size_t mark) {
+	const size_t peak = _test_arena.peak - mark;
+	if (_test_state->arena_poison && _test_arena.used > mark) {
+		memset(_test_arena.base + mark, 0xa5, _test_arena.used - mark);
+	}
+	_test_arena.used = _test_arena.peak = mark;
+	return peak;
+}
+
+static void _test_print_bytes(FILE *out, size_t bytes) {
+	if (bytes < 1024) fprintf(out, "%zuB", bytes);
+	else if (bytes < 1 << 20) fprintf(out, "%.1fK", (double)bytes / 1024);
+	else fprintf(out, "%.1fM", (double)bytes / (1 << 20));
+}
+
+// Counters benchmark bodies keep with bench_count, like bytes processed or
+// cache hits. They're summed over the samples and reported as totals, per
+// iteration and per second.
+
+// The benchmark whose sample is running
+static _test_t *_test_counting;
+
+// Adds n to the running benchmark's counter called name. Outside of a
+// benchmark, or past TEST_COUNTERS counters, it does nothing.
+static inline void bench_count(const char *name, double n) {
+	_test_t *test = _test_counting;
+	if (!test) return;
+	// Names are usually the same string literal every time
+	for (int i = 0; i < test->ncounters; i++) {
+		if (test->counters[i].name != name) continue;
+		test->counters[i].total += n;
+		return;
+	}
+	for (int i = 0; i < test->ncounters; i++) {
+		if (strcmp(test->counters[i].name, name)) continue;
+		test->counters[i].total += n;
+		return;
+	}
+	if (test->ncounters == TEST_COUNTERS) return;
+	test->counters[test->ncounters].name = name;
+	test->counters[test->ncounters++].total = n;
+}
+
+// Counts heap allocations made by the whole process so benchmarks can report
+// allocations per iteration. Opt in with TEST_ALLOC_COUNT, as it replaces the
+// program's malloc. Only possible where the allocator can be interposed and no
+// sanitizer owns malloc already.
+#if defined(__GLIBC__) && defined(TEST_ALLOC_COUNT)
+# define _TEST_ALLOC_COUNT
+# if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#  undef _TEST_ALLOC_COUNT
+# elif defined(__has_feature)
+#  if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)     \
+	  || __has_feature(memory_sanitizer)
+#   undef _TEST_ALLOC_COUNT
+#  endif
+# endif
+#endif
+
+size_t _test_nallocs;
+
+#ifdef _TEST_ALLOC_COUNT
+_TEST_C void *__libc_malloc(size_t);
+_TEST_C void *__libc_calloc(size_t, size_t);
+_TEST_C void *__libc_realloc(void *, size_t);
+
+_TEST_C void *malloc(size_t size) _TEST_NOEXCEPT {
+	__atomic_fetch_add(&_test_nallocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+_TEST_C void *calloc(size_t nmemb, size_t size) _TEST_NOEXCEPT {
+	__atomic_fetch_add(&_test_nallocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+_TEST_C void *realloc(void *ptr, size_t size) _TEST_NOEXCEPT {
+	__atomic_fetch_add(&_test_nallocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static uint64_t _test_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t _test_rand(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x >> 12, x ^= x << 25, x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double _test_sqrt(double x) {
+	if (x <= 0.0) return 0.0;
+	double r = x > 1.0 ? x : 1.0;
+	for (int i = 0; i < 64; i++) r = (r + x / r) / 2.0;
+	return r;
+}
+
+static int _test_cmp_double(const void *a, const void *b) {
+	const double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Sorts the samples and fills in everything but iters and allocs
+static void _test_summarize(_test_stats_t *stats, double *samples, size_t n) {
+	qsort(samples, n, sizeof(*samples), _test_cmp_double);
+	double sum = 0.0;
+	for (size_t i = 0; i < n; i++) sum += samples[i];
+
+	// Distribution-free 95% confidence interval of the median, taken from
+	// the order statistics around it
+	const double mid = (double)n / 2.0, spread = 1.96 * _test_sqrt(n) / 2.0;
+	const size_t lo = mid > spread ? (size_t)(mid - spread) : 0;
+	const size_t hi = (size_t)(mid + spread + 1.0) < n
+		? (size_t)(mid + spread + 1.0)
+		: n - 1;
+
+	stats->nsamples = n;
+	stats->mean = sum / (double)n;
+	stats->median = n % 2 ? samples[n / 2]
+			      : (samples[n / 2 - 1] + samples[n / 2]) / 2.0;
+	stats->lo = samples[lo], stats->hi = samples[hi];
+	stats->min = samples[0], stats->max = samples[n - 1];
+}
+
+// Runs the benchmark body over its whole array iters times and returns how
+// long it took in nanoseconds. Never inlined so the profiler knows where the
+// benchmark's stack starts.
+__attribute__((noinline)) static uint64_t _test_bench_sample(
+	_test_bench_t *bench, size_t iters) {
+	if (bench->sample) return bench->sample(bench, iters);
+	const uint64_t start = _test_now();
+	if (bench->batch) {
+		const size_t chunk = bench->chunk;
+		for (size_t i = 0; i < iters; i++) {
+			uintptr_t addr = (uintptr_t)bench->array;
+			for (size_t n = 0; n < bench->nitems; n += chunk) {
+				const size_t len = bench->nitems - n < chunk
+					? bench->nitems - n
+					: chunk;
+				bench->batch((void *)addr, len);
+				addr += chunk * bench->step;
+			}
+		}
+		return _test_now() - start;
+	}
+	if (bench->indices) {
+		const uintptr_t array = (uintptr_t)bench->array;
+		const size_t step = bench->step;
+		for (size_t i = 0; i < iters; i++) {
+			const size_t *perm = bench->indices
+				+ i % bench->nperms * bench->nitems;
+			for (size_t n = 0; n < bench->nitems; n++) {
+				bench->fn((void *)(array + perm[n] * step));
+			}
+		}
+		return _test_now() - start;
+	}
+	for (size_t i = 0; i < iters; i++) {
+		uintptr_t addr = (uintptr_t)bench->array;
+		for (size_t n = 0; n < bench->nitems; n++) {
 			bench->fn((void *)addr);
+			addr += bench->step;
 		}
 	}
-	clock_t end = clock();
+	return _test_now() - start;
+}
 
-	printf("\x1B[34m[RAN]\x1B[0m %s (%-8zd iters) in ",
-	       name,
-	       bench->iters * bench->nitems);
+#ifndef TEST_ORDER_MAX
+// Most indices precomputed for a sample, shuffled benchmarks over big arrays
+// reuse their permutations after this many
+# define TEST_ORDER_MAX ((size_t)1 << 23)
+#endif
 
-	double secs = ((double)end - (double)start) / (double)CLOCKS_PER_SEC;
-	if (secs < 1.0 / 1000.0) printf("%6.2fus ", secs * 1000000.0);
-	else printf("%6.2fms ", secs * 1000.0);
+// Computes the indices for the next sample of iters iterations, with fresh
+// permutations for shuffled benchmarks
+static void _test_bench_order(_test_bench_t *bench, size_t iters) {
+	const size_t n = bench->nitems, order = bench->order;
+	if (order == TEST_ORDER_SEQUENTIAL || !n || bench->batch) return;
+	size_t nperms = order == TEST_ORDER_SHUFFLE ? iters : 1;
+	if (nperms > TEST_ORDER_MAX / n) nperms = TEST_ORDER_MAX / n;
+	if (!nperms) nperms = 1;
+	if (!bench->indices || nperms > bench->nperms) {
+		free(bench->indices);
+		bench->indices = (size_t *)malloc(nperms * n * sizeof(size_t));
+		if (!bench->indices) return;
+	} else if (order != TEST_ORDER_SHUFFLE) {
+		return;
+	}
+	bench->nperms = nperms;
 
-	secs /= (double)(bench->iters * bench->nitems);
-	printf("(");
-	if (secs < 1.0 / 1000.0) printf("%6.2fus ", secs * 1000000.0);
-	else printf("%6.2fms ", secs * 1000.0);
-	printf("per iter)\n");
+	size_t *idx = bench->indices;
+	if (order == TEST_ORDER_REVERSE) {
+		for (size_t i = 0; i < n; i++) idx[i] = n - 1 - i;
+	} else if ((order & 3) == 3) {
+		const size_t stride = order >> 8 ? order >> 8 : 1;
+		size_t at = 0;
+		for (size_t first = 0; first < stride && first < n; first++) {
+			for (size_t i = first; i < n; i += stride) {
+				idx[at++] = i;
+			}
+		}
+	} else {
+		for (size_t p = 0; p < nperms; p++, idx += n) {
+			for (size_t i = 0; i < n; i++) idx[i] = i;
+			for (size_t i = n - 1; i > 0; i--) {
+				const size_t j = (size_t)(_test_rand(
+					&_test_state->rng) % (i + 1));
+				const size_t tmp = idx[i];
+				idx[i] = idx[j], idx[j] = tmp;
+			}
+		}
+	}
 }
 
-static bool _test_run(_test_t *test, _test_state_t *state) {
-	int fail_line = test->testfn();
-	printf("%s\x1B[0m %s",
-	       !fail_line ? "\x1B[32m[PASS]" : "\x1B[31m[FAIL]",
-	       test->name);
-	if (fail_line) printf(" (on line %d)", fail_line);
-	printf("\n");
-	state->passed += !fail_line, state->ran++;
-	return !fail_line;
+// Sampling profiler for --profile. A SIGPROF timer is only armed while a
+// benchmark's timed loop runs and the handler just copies the raw stack into a
+// buffer allocated up front, symbolizing is left for the end. The timer runs
+// on the monotonic clock since CPU time timers only fire on scheduler ticks.
+static struct {
+	uintptr_t *buf;
+	size_t len, cap, dropped;
+	const _test_t *current;
+	int outer;
+	timer_t timer;
+} _test_prof;
+
+static void _test_prof_signal(int sig) {
+	(void)sig;
+	const int saved = errno;
+	void *frames[128];
+	const int n = backtrace(frames, 128);
+
+	// Drops this handler, the signal trampoline and everything from
+	// _test_bench_sample out
+	const int keep = n - 2 - _test_prof.outer - 1;
+	if (_test_prof.len + 2 + (keep > 0 ? keep : 0) > _test_prof.cap) {
+		_test_prof.dropped++;
+	} else {
+		uintptr_t *rec = _test_prof.buf + _test_prof.len;
+		rec[0] = (uintptr_t)_test_prof.current;
+		rec[1] = keep > 0 ? (uintptr_t)keep : 0;
+		for (int i = 0; i < keep; i++) {
+			rec[2 + i] = (uintptr_t)frames[2 + i];
+		}
+		_test_prof.len += 2 + rec[1];
+	}
+	errno = saved;
 }
 
-static void _test_start(_test_state_t *state) {
-	memset(state, 0, sizeof(*state));
+__attribute__((noinline)) static void _test_prof_arm(const _test_t *test) {
+	if (!_test_prof.buf) return;
+	// Everything on the stack from here out is outside the benchmark
+	void *frames[128];
+	_test_prof.outer = backtrace(frames, 128) - 1;
+	_test_prof.current = test;
+	const long nsecs = 1000000000 / TEST_PROFILE_HZ;
+	const struct itimerspec timer = {{0, nsecs}, {0, nsecs}};
+	timer_settime(_test_prof.timer, 0, &timer, NULL);
+}
+
+static void _test_prof_disarm(void) {
+	if (!_test_prof.buf) return;
+	const struct itimerspec timer = {{0, 0}, {0, 0}};
+	timer_settime(_test_prof.timer, 0, &timer, NULL);
+}
+
+static bool _test_prof_start(void) {
+	struct sigevent event;
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_SIGNAL;
+	event.sigev_signo = SIGPROF;
+	if (timer_create(CLOCK_MONOTONIC, &event, &_test_prof.timer)) {
+		fprintf(stderr, "can't create the profiling timer\n");
+		return false;
+	}
+	_test_prof.cap = 1 << 22;
+	_test_prof.buf =
+		(uintptr_t *)malloc(_test_prof.cap * sizeof(uintptr_t));
+	if (!_test_prof.buf) return false;
+	// The first backtrace loads the unwinder, which can't happen in the
+	// signal handler
+	void *frames[1];
+	backtrace(frames, 1);
+	signal(SIGPROF, _test_prof_signal);
+	return true;
+}
+
+static int _test_cmp_str(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Turns "binary(function+0x12) [0x...]" into function, or binary+0x... when
+// the symbol isn't exported
+static void _test_prof_frame(FILE *out, const char *sym) {
+	const char *open = strchr(sym, '(');
+	const char *plus = open ? strchr(open, '+') : NULL;
+	if (open && plus && plus > open + 1) {
+		fprintf(out, ";%.*s", (int)(plus - open - 1), open + 1);
+		return;
+	}
+	const char *base = strrchr(sym, '/');
+	base = base ? base + 1 : sym;
+	const size_t len = open ? (size_t)(open - base) : strcspn(base, " ");
+	const char *off = plus ? plus : "";
+	fprintf(out, ";%.*s%.*s", (int)len, base, (int)strcspn(off, ")"), off);
+}
+
+// Writes dir/name.folded for the benchmark, one line per distinct stack with
+// the benchmark's name at the root and the sample count at the end
+static void _test_prof_write(const char *dir, const _test_t *test) {
+	uintptr_t *buf = _test_prof.buf;
+	size_t nlines = 0;
+	for (size_t at = 0; at < _test_prof.len; at += 2 + buf[at + 1]) {
+		nlines += buf[at] == (uintptr_t)test;
+	}
+	if (!nlines) return;
+	char **lines = (char **)malloc(nlines * sizeof(char *));
+	if (!lines) return;
+
+	size_t n = 0;
+	for (size_t at = 0; at < _test_prof.len; at += 2 + buf[at + 1]) {
+		if (buf[at] != (uintptr_t)test) continue;
+		const int depth = (int)buf[at + 1];
+		void **frames = (void **)&buf[at + 2];
+		char **syms = depth ? backtrace_symbols(frames, depth) : NULL;
+		size_t len;
+		FILE *line = open_memstream(&lines[n], &len);
+		fputs(test->name, line);
+		for (int i = depth - 1; syms && i >= 0; i--) {
+			_test_prof_frame(line, syms[i]);
+		}
+		fclose(line);
+		free(syms);
+		n++;
+	}
+
+	char path[1024];
+	// Variants like name/16 and name/cold go next to the others, as
+	// name_16.folded
+	char name[256];
+	snprintf(name, sizeof(name), "%s", test->name);
+	for (char *at = name; *at; at++) {
+		if (*at == '/') *at = '_';
+	}
+	snprintf(path, sizeof(path), "%s/%s.folded", dir, name);
+	FILE *out = fopen(path, "w");
+	if (!out) {
+		fprintf(stderr, "can't write profile %s\n", path);
+	} else {
+		qsort(lines, n, sizeof(char *), _test_cmp_str);
+		for (size_t i = 0, count = 1; i < n; i++, count++) {
+			if (i + 1 < n && !strcmp(lines[i], lines[i + 1])) {
+				continue;
+			}
+			fprintf(out, "%s %zu\n", lines[i], count);
+			count = 0;
+		}
+		fclose(out);
+	}
+	for (size_t i = 0; i < n; i++) free(lines[i]);
+	free(lines);
 }
 
-static int _test_end(_test_state_t *state) {
-	printf("%d/%d tests passed\n", state->passed, state->ran);
+// perf's control protocol, so `perf record --control` can be started disabled
+// and only record the benchmarks' timed loops. The thread is renamed to the
+// benchmark while it runs, which perf records as a comm change so samples can
+// be split per benchmark with --sort comm.
+static struct {
+	int ctl, ack;
+} _test_perf = {-1, -1};
+
+// Comms are cut at 15 characters, so longer names become #index and as much
+// of their end as fits (where name/size and name/cold style variants
+// differ). _test_perf_names lists them.
+static void _test_perf_comm(const _test_t *test, char *comm) {
+	const size_t len = strlen(test->name);
+	if (len < 16) {
+		memcpy(comm, test->name, len + 1);
+		return;
+	}
+	int index = 0;
+	while (index < _test_state->nbenches
+	       && _test_state->benches[index] != test) {
+		index++;
+	}
+	const int prefix = snprintf(comm, 16, "#%d ", index);
+	snprintf(comm + prefix,
+		 16 - (size_t)prefix,
+		 "%s",
+		 test->name + len - (15 - (size_t)prefix));
+}
 
-	// Run benchmarks if there is any
-	if (state->nbenches) printf("\n");
+static void _test_perf_names(const _test_state_t *state) {
+	if (_test_perf.ctl < 0) return;
 	for (int i = 0; i < state->nbenches; i++) {
-		_test_run_bench(
-			state->benches[i]->name, &state->benches[i]->bench);
+		const _test_t *test = state->benches[i];
+		if (test->kind == _TEST_GROUP || strlen(test->name) < 16) {
+			continue;
+		}
+		char comm[16];
+		_test_perf_comm(test, comm);
+		fprintf(stderr, "perf comm %s is %s\n", comm, test->name);
 	}
+}
 
-	return state->passed == state->ran ? 0 : 1;
+static void _test_perf_cmd(const char *cmd) {
+	if (write(_test_perf.ctl, cmd, strlen(cmd)) < 0) return;
+	// Waits for perf to have done it, so the timing doesn't start early
+	char ack[16];
+	if (_test_perf.ack >= 0 && read(_test_perf.ack, ack, sizeof(ack)) < 0) {
+		_test_perf.ack = -1;
+	}
 }
 
-#define _test_tryrun(_test)                                                    \
-	if (_test.istest) {                                                    \
-		_test_run(&_test, state);                                      \
-	} else {                                                               \
-		if (!_test.bench.fn) return;                                   \
-		state->benches[state->nbenches++] = &_test;                    \
+static void _test_perf_begin(const _test_t *test) {
+	if (_test_perf.ctl < 0) return;
+	char comm[16];
+	_test_perf_comm(test, comm);
+	prctl(PR_SET_NAME, comm);
+	_test_perf_cmd("enable\n");
+}
+
+static void _test_perf_end(void) {
+	if (_test_perf.ctl < 0) return;
+	_test_perf_cmd("disable\n");
+	prctl(PR_SET_NAME, _test_state->progname);
+}
+
+// Opens the ctl[,ack] fifos, or takes the fds from $PERF_CTL_FD and
+// $PERF_ACK_FD when there's no path
+static bool _test_perf_start(const char *fifos) {
+	if (!fifos) {
+		const char *ctl = getenv("PERF_CTL_FD");
+		const char *ack = getenv("PERF_ACK_FD");
+		_test_perf.ctl = ctl && *ctl ? atoi(ctl) : -1;
+		_test_perf.ack = ack && *ack ? atoi(ack) : -1;
+		return true;
 	}
+	char ctl[512];
+	snprintf(ctl, sizeof(ctl), "%.*s", (int)strcspn(fifos, ","), fifos);
+	const char *ack = strchr(fifos, ',');
+	_test_perf.ctl = open(ctl, O_WRONLY | O_CLOEXEC);
+	if (ack) _test_perf.ack = open(ack + 1, O_RDONLY | O_CLOEXEC);
+	if (_test_perf.ctl < 0 || (ack && _test_perf.ack < 0)) {
+		fprintf(stderr, "can't open perf control fifo %s\n", fifos);
+		return false;
+	}
+	return true;
+}
 
-static void _tests_run_tests(_test_state_t *state);
+// Benchmark buffers. They're mmapped rather than malloced so their alignment
+// and page size are the same from one build to the next, and faulted in up
+// front so first touches aren't timed.
+typedef struct _test_buffer {
+	void *addr, *map;
+	size_t size, mapsize, huge;
+	int pages;
+	char backing[64];
+} _test_buffer_t;
 
-int main(int argc, char **argv) {
-	_test_state_t state;
-	_test_start(&state);
-	_tests_run_tests(&state);
-	return _test_end(&state);
+static _test_buffer_t _test_buffers[256];
+static int _test_nbuffers;
+
+#define _TEST_HUGE_PAGE ((size_t)2 << 20)
+
+// Bytes of the mapping around addr backed by transparent huge pages
+static size_t _test_thp_bytes(const void *addr) {
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	if (!smaps) return 0;
+	char line[256];
+	bool found = false;
+	size_t kb = 0;
+	while (fgets(line, sizeof(line), smaps)) {
+		unsigned long lo, hi;
+		if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+			if (found) break;
+			found = (uintptr_t)addr >= lo && (uintptr_t)addr < hi;
+		} else if (found
+			   && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+			break;
+		}
+	}
+	fclose(smaps);
+	return kb << 10;
+}
+
+// Allocates size bytes aligned to align (at least a page) on small pages,
+// transparent huge pages (TEST_PAGES_HUGE) or reserved huge pages
+// (TEST_PAGES_HUGETLB). Falls back to the next kind down when the one asked
+// for isn't available, which the benchmarks using it report.
+static inline void *bench_alloc(size_t size, size_t align, int pages) {
+	if (_test_nbuffers == 256) return NULL;
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	if (align < page) align = page;
+	if (pages != TEST_PAGES_SMALL && align < _TEST_HUGE_PAGE) {
+		align = _TEST_HUGE_PAGE;
+	}
+	if (align & (align - 1)) return NULL;
+	const size_t len = ((size ? size : 1) + align - 1) & ~(align - 1);
+
+	_test_buffer_t *buf = &_test_buffers[_test_nbuffers];
+	memset(buf, 0, sizeof(*buf));
+	buf->map = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (pages == TEST_PAGES_HUGETLB) {
+		buf->mapsize = len;
+		buf->map = mmap(NULL,
+				len,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+				-1,
+				0);
+		if (buf->map != MAP_FAILED && (uintptr_t)buf->map % align) {
+			munmap(buf->map, len);
+			buf->map = MAP_FAILED;
+		}
+		if (buf->map != MAP_FAILED) {
+			buf->addr = buf->map, buf->huge = len;
+			snprintf(buf->backing,
+				 sizeof(buf->backing),
+				 "hugetlb pages");
+		}
+	}
+#endif
+	if (buf->map == MAP_FAILED) {
+		// Mapped with room to spare and rounded up to the alignment
+		buf->mapsize = len + align - page;
+		buf->map = mmap(NULL,
+				buf->mapsize,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS,
+				-1,
+				0);
+		if (buf->map == MAP_FAILED) return NULL;
+		buf->addr = (void *)(((uintptr_t)buf->map + align - 1)
+				     & ~(uintptr_t)(align - 1));
+#ifdef MADV_HUGEPAGE
+		if (pages != TEST_PAGES_SMALL) {
+			madvise(buf->addr, len, MADV_HUGEPAGE);
+		}
+#endif
+#ifdef MADV_NOHUGEPAGE
+		if (pages == TEST_PAGES_SMALL) {
+			madvise(buf->addr, len, MADV_NOHUGEPAGE);
+		}
+#endif
+	}
+	memset(buf->addr, 0, len);
+
+	if (!*buf->backing) {
+		if (pages != TEST_PAGES_SMALL) {
+			buf->huge = _test_thp_bytes(buf->addr);
+		}
+		if (pages == TEST_PAGES_SMALL) {
+			snprintf(buf->backing,
+				 sizeof(buf->backing),
+				 "%zuK pages",
+				 page >> 10);
+		} else if (!buf->huge) {
+			snprintf(buf->backing,
+				 sizeof(buf->backing),
+				 "%zuK pages, no huge pages available",
+				 page >> 10);
+		} else {
+			snprintf(buf->backing,
+				 sizeof(buf->backing),
+				 "transparent huge pages (%.0f%%)%s",
+				 (double)(buf->huge < len ? buf->huge : len)
+					 / (double)len * 100.0,
+				 pages == TEST_PAGES_HUGETLB
+					 ? ", no hugetlb pages"
+					 : "");
+		}
+	}
+	buf->size = size, buf->pages = pages;
+	_test_nbuffers++;
+	return buf->addr;
+}
+
+static inline void bench_free(void *addr) {
+	for (int i = 0; i < _test_nbuffers; i++) {
+		if (_test_buffers[i].addr != addr) continue;
+		munmap(_test_buffers[i].map, _test_buffers[i].mapsize);
+		_test_buffers[i] = _test_buffers[--_test_nbuffers];
+		return;
+	}
+}
+
+// The buffer addr points into, if bench_alloc made it
+static const _test_buffer_t *_test_buffer_find(const void *addr) {
+	for (int i = 0; i < _test_nbuffers; i++) {
+		const _test_buffer_t *buf = &_test_buffers[i];
+		const uint8_t *start = (const uint8_t *)buf->addr,
+			      *ptr = (const uint8_t *)addr;
+		if (ptr == start || (ptr > start && ptr < start + buf->size)) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+// Remembers what the benchmark's array is backed by, for the reports after
+// the buffer is gone
+static void _test_bench_note_backing(_test_t *test) {
+	const _test_buffer_t *buf = test->bench.array
+		? _test_buffer_find(test->bench.array)
+		: NULL;
+	if (!buf || buf->pages == TEST_PAGES_SMALL) return;
+	memcpy(test->bench.backing, buf->backing, sizeof(buf->backing));
+	test->bench.huge = buf->huge < buf->size ? buf->huge : buf->size;
+}
+
+static const char *_test_bench_backing(const _test_t *test) {
+	return test->kind == _TEST_BENCH && *test->bench.backing
+		? test->bench.backing
+		: NULL;
+}
+
+// Files for bench_file. posix_fadvise only evicts clean pages, so the file is
+// synced once it's written. On tmpfs the page cache is the file, so nothing
+// is evicted there and cold is as warm as warm.
+#define _TEST_TMPFS_MAGIC 0x01021994
+
+// Bytes read, read calls and bytes read from storage by the whole process,
+// from /proc/self/io. Returns how many bytes reading it took, or 0 if it
+// isn't there.
+static size_t _test_io(size_t io[3]) {
+	static int fd = -2;
+	if (fd == -2) fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+	char buf[512];
+	const ssize_t len = fd < 0 ? -1 : pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) return 0;
+	buf[len] = '\0';
+	const char *keys[3] = {"rchar: ", "syscr: ", "read_bytes: "};
+	for (int i = 0; i < 3; i++) {
+		const char *at = strstr(buf, keys[i]);
+		if (!at) return 0;
+		io[i] = strtoull(at + strlen(keys[i]), NULL, 10);
+	}
+	return (size_t)len;
+}
+
+// Counts from before the sample. The read that took them is only accounted
+// for after it returns, so it's in the next counts and taken off there.
+static size_t _test_io_start[3], _test_io_len;
+
+static void _test_file_begin(_test_t *test) {
+	const _test_bench_t *bench = &test->bench;
+	if (!bench->filesize || !bench->array) return;
+	const test_file_t *file = (const test_file_t *)bench->array;
+	if (bench->cold) posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+	_test_io_len = _test_io(_test_io_start);
+}
+
+static void _test_file_end(_test_t *test) {
+	size_t io[3];
+	if (!test->bench.filesize || !_test_io_len || !_test_io(io)) return;
+	const size_t bytes = io[0] - _test_io_start[0] - _test_io_len;
+	const size_t calls = io[1] - _test_io_start[1] - 1;
+	_test_counting = test;
+	bench_count("bytes", (double)bytes);
+	bench_count("read_calls", (double)calls);
+	bench_count("storage_bytes", (double)(io[2] - _test_io_start[2]));
+	_test_counting = NULL;
+}
+
+static bool _test_file_write(int fd, size_t size) {
+	uint64_t buf[8192];
+	uint64_t rng = _test_state->seed;
+	for (size_t off = 0; off < size;) {
+		for (size_t i = 0; i < sizeof(buf) / sizeof(buf[0]); i++) {
+			buf[i] = _test_rand(&rng);
+		}
+		const size_t len =
+			size - off < sizeof(buf) ? size - off : sizeof(buf);
+		const ssize_t n = write(fd, buf, len);
+		if (n <= 0) return false;
+		off += (size_t)n;
+	}
+	return !fsync(fd);
+}
+
+static inline bool _test_file_prepare(_test_t *test) {
+	_test_bench_t *bench = &test->bench;
+	const char *dir = getenv("TMPDIR");
+	test_file_t *file = (test_file_t *)calloc(1, sizeof(*file));
+	char *path = NULL;
+	if (!file
+	    || asprintf(&path,
+			"%s/%s.XXXXXX",
+			dir && *dir ? dir : "/var/tmp",
+			_test_state->progname)
+		    < 0) {
+		free(file);
+		test->skip = "file allocation failed";
+		return false;
+	}
+	file->path = path, file->size = bench->filesize, file->align = 1;
+	file->fd = mkstemp(path);
+	struct stat st;
+	struct statfs fs;
+	if (file->fd < 0 || !_test_file_write(file->fd, file->size)
+	    || fstat(file->fd, &st) || fstatfs(file->fd, &fs)) {
+		if (file->fd >= 0) unlink(path), close(file->fd);
+		free(path), free(file);
+		test->skip = "can't write the file";
+		return false;
+	}
+	bench->array = file, bench->nitems = 1;
+
+	if (bench->fileflags & TEST_DIRECT) {
+		const int fd = open(path, O_RDONLY | O_DIRECT);
+		if (fd >= 0) {
+			close(file->fd);
+			file->fd = fd;
+			file->align = st.st_blksize >= 512
+				? (size_t)st.st_blksize
+				: 4096;
+			snprintf(bench->backing,
+				 sizeof(bench->backing),
+				 "O_DIRECT, %zu byte aligned",
+				 file->align);
+		} else {
+			snprintf(bench->backing,
+				 sizeof(bench->backing),
+				 "buffered reads, O_DIRECT unsupported");
+		}
+	} else if (bench->cold && fs.f_type == _TEST_TMPFS_MAGIC) {
+		snprintf(bench->backing,
+			 sizeof(bench->backing),
+			 "tmpfs, which can't be evicted");
+	} else if (!bench->cold) {
+		// Cached up front, samples leave it that way
+		char buf[1 << 16];
+		for (off_t off = 0;; off += (off_t)sizeof(buf)) {
+			if (pread(file->fd, buf, sizeof(buf), off) <= 0) break;
+		}
+	}
+	return true;
+}
+
+static inline void _test_file_release(_test_t *test) {
+	test_file_t *file = (test_file_t *)test->bench.array;
+	if (!file) return;
+	close(file->fd);
+	unlink(file->path);
+	free((char *)file->path);
+	free(file);
+	test->bench.array = NULL;
+}
+
+static inline bool _test_gen_prepare(struct _test *test);
+static inline void _test_gen_release(struct _test *test);
+static inline bool _test_corpus_prepare(struct _test *test);
+static inline void _test_corpus_release(struct _test *test);
+
+// Cold file benchmarks take one iteration per sample, as the file is only
+// evicted before each sample
+static size_t _test_bench_nsamples(const _test_bench_t *bench) {
+	const size_t n = bench->iters < TEST_SAMPLES || bench->cold
+		? bench->iters
+		: TEST_SAMPLES;
+	return n ? n : 1;
+}
+
+// Iterations in sample r. The first iters % nsamples samples take one more so
+// they add up to iters.
+static size_t _test_bench_iters(const _test_bench_t *bench, size_t r) {
+	const size_t n = _test_bench_nsamples(bench);
+	const size_t iters = bench->iters / n + (r < bench->iters % n);
+	return iters ? iters : 1;
+}
+
+// Splits the benchmarks' iterations into samples and collects statistics on
+// them. The benchmarks take turns running one sample each, so slow drift in
+// the machine's speed hits all of them equally, in a new random order every
+// round with --shuffle. Only ever done once per benchmark.
+static void _test_bench_measure_all(_test_t **tests, int n) {
+	int order[1024];
+	for (int i = 0; i < n; i++) order[i] = i;
+	size_t rounds = 0;
+	for (int i = 0; i < n; i++) {
+		_test_t *test = tests[i];
+		if (test->measured) continue;
+		if (test->bench.prepare && !test->bench.prepare(test)) {
+			test->measured = true;
+			continue;
+		}
+		_test_bench_note_backing(test);
+		const size_t nsamples = _test_bench_nsamples(&test->bench);
+		test->samples = (double *)malloc(nsamples * sizeof(double));
+		test->stats.allocs = 0.0;
+		if (nsamples > rounds) rounds = nsamples;
+	}
+
+	for (size_t r = 0; r < rounds; r++) {
+		for (int i = n - 1; _test_state->shuffle && i > 0; i--) {
+			const int j = (int)(_test_rand(&_test_state->rng)
+					    % (uint64_t)(i + 1));
+			const int tmp = order[i];
+			order[i] = order[j], order[j] = tmp;
+		}
+		for (int i = 0; i < n; i++) {
+			_test_t *test = _test_state->shuffle
+				? tests[order[i]]
+				: tests[(r + i) % n];
+			_test_bench_t *bench = &test->bench;
+			if (test->measured) continue;
+			if (r >= _test_bench_nsamples(bench)) continue;
+
+			const size_t iters = _test_bench_iters(bench, r);
+			const size_t mark = _test_arena.used;
+			_test_bench_order(bench, iters);
+			_test_file_begin(test);
+			const size_t allocs = __atomic_load_n(
+				&_test_nallocs, __ATOMIC_RELAXED);
+			_test_perf_begin(test);
+			_test_prof_arm(test);
+			_test_counting = test;
+			const uint64_t ns = _test_bench_sample(bench, iters);
+			_test_counting = NULL;
+			_test_prof_disarm();
+			_test_perf_end();
+			_test_file_end(test);
+			const size_t peak = _test_arena_rewind(mark);
+			if (peak > test->arena_peak) test->arena_peak = peak;
+			test->samples[r] =
+				(double)ns / (double)(iters * bench->nitems);
+			test->stats.allocs += (double)(__atomic_load_n(
+							       &_test_nallocs,
+							       __ATOMIC_RELAXED)
+							       - allocs);
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		_test_t *test = tests[i];
+		if (test->measured) continue;
+		const _test_bench_t *bench = &test->bench;
+		const size_t nsamples = _test_bench_nsamples(bench);
+		_test_summarize(&test->stats, test->samples, nsamples);
+		test->stats.iters = 0;
+		for (size_t r = 0; r < nsamples; r++) {
+			test->stats.iters +=
+				_test_bench_iters(bench, r) * bench->nitems;
+		}
+		test->stats.allocs /= (double)test->stats.iters;
+		test->measured = true;
+		free(test->samples);
+		free(test->bench.indices);
+		test->samples = NULL, test->bench.indices = NULL;
+		if (test->bench.release) test->bench.release(test);
+	}
+}
+
+static inline bool _test_gen_prepare(_test_t *test) {
+	_test_bench_t *bench = &test->bench;
+	bench->nitems = bench->count();
+	if (!bench->nitems) {
+		test->skip = "empty dataset";
+		return false;
+	}
+	if (bench->nitems > SIZE_MAX / bench->step
+	    || !(bench->array = bench_alloc(bench->nitems * bench->step,
+					    0,
+					    _test_state->pages))) {
+		test->skip = "dataset allocation failed";
+		return false;
+	}
+	bench->gen(bench->array, bench->nitems);
+	const uint8_t *bytes = (const uint8_t *)bench->array;
+	const size_t len = bench->nitems * bench->step;
+	bench->input = 14695981039346656037ULL;
+	for (size_t i = 0; i < len && i < ((size_t)1 << 20); i++) {
+		bench->input = (bench->input ^ bytes[i]) * 1099511628211ULL;
+	}
+	return true;
+}
+
+static inline void _test_gen_release(_test_t *test) {
+	bench_free(test->bench.array);
+	test->bench.array = NULL;
+}
+
+// Splits the mapped corpus into records, or only counts them if records is
+// NULL
+static size_t _test_corpus_split(
+	const _test_bench_t *bench, test_record_t *records) {
+	const uint8_t *data = (const uint8_t *)bench->map;
+	const size_t size = bench->mapsize, recsize = bench->format >> 8;
+	size_t n = 0;
+	switch (bench->format & 3) {
+	case TEST_LINES:
+		for (size_t off = 0; off < size;) {
+			const uint8_t *end = (const uint8_t *)memchr(
+				data + off, '\n', size - off);
+			const size_t len = end ? (size_t)(end - data) - off
+					       : size - off;
+			if (records) {
+				records[n].data = data + off;
+				records[n].len = len;
+			}
+			n++, off += len + 1;
+		}
+		break;
+	case TEST_LEN32:
+		for (size_t off = 0; off + 4 <= size;) {
+			const size_t len = (size_t)data[off]
+				| (size_t)data[off + 1] << 8
+				| (size_t)data[off + 2] << 16
+				| (size_t)data[off + 3] << 24;
+			if (len > size - off - 4) break;
+			if (records) {
+				records[n].data = data + off + 4;
+				records[n].len = len;
+			}
+			n++, off += len + 4;
+		}
+		break;
+	default:
+		if (!recsize) break;
+		for (size_t off = 0; off + recsize <= size; off += recsize) {
+			if (records) {
+				records[n].data = data + off;
+				records[n].len = recsize;
+			}
+			n++;
+		}
+		break;
+	}
+	return n;
+}
+
+static inline bool _test_corpus_prepare(_test_t *test) {
+	_test_bench_t *bench = &test->bench;
+	const int fd = open(bench->path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0 || !st.st_size) {
+		if (fd >= 0) close(fd);
+		test->skip = "can't open corpus or it is empty";
+		return false;
+	}
+
+	int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	if (bench->format & TEST_POPULATE) flags |= MAP_POPULATE;
+#endif
+	bench->mapsize = (size_t)st.st_size;
+	bench->map = mmap(NULL, bench->mapsize, PROT_READ, flags, fd, 0);
+	close(fd);
+	if (bench->map == MAP_FAILED) {
+		bench->map = NULL;
+		test->skip = "can't mmap corpus";
+		return false;
+	}
+
+	// Touch every page too in case MAP_POPULATE didn't (or doesn't exist)
+	if (bench->format & TEST_POPULATE) {
+		const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		volatile uint8_t sink = 0;
+		for (size_t off = 0; off < bench->mapsize; off += page) {
+			sink = sink + ((const uint8_t *)bench->map)[off];
+		}
+	}
+
+	bench->nitems = _test_corpus_split(bench, NULL);
+	if (!bench->nitems) {
+		_test_corpus_release(test);
+		test->skip = "corpus has no records";
+		return false;
+	}
+	bench->array = malloc(bench->nitems * sizeof(test_record_t));
+	if (!bench->array) {
+		_test_corpus_release(test);
+		test->skip = "corpus index allocation failed";
+		return false;
+	}
+	_test_corpus_split(bench, (test_record_t *)bench->array);
+	return true;
+}
+
+static inline void _test_corpus_release(_test_t *test) {
+	_test_bench_t *bench = &test->bench;
+	if (bench->map) munmap(bench->map, bench->mapsize);
+	free(bench->array);
+	bench->map = bench->array = NULL;
 }
 
+// Pair benchmarks. Both threads are pinned and wait on each other by spinning,
+// yielding now and then in case they share a core.
+static inline void _test_spin(size_t *spins) {
+	if (!(++*spins % 1024)) {
+		sched_yield();
+		return;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+typedef struct _test_pair_run {
+	_test_t *test;
+	size_t rounds, warmup;
+	double *oneway, *rtt;
+	uint64_t sent, acked, start, end;
+	int ready, failed;
+} _test_pair_run_t;
+
+typedef struct _test_pair_side {
+	_test_pair_run_t *run;
+	bool producer;
+} _test_pair_side_t;
+
+// Waits for the other thread to get to the same point
+static void _test_pair_barrier(_test_pair_run_t *run, int count) {
+	__atomic_fetch_add(&run->ready, 1, __ATOMIC_ACQ_REL);
+	for (size_t spins = 0;
+	     __atomic_load_n(&run->ready, __ATOMIC_ACQUIRE) < count;) {
+		_test_spin(&spins);
+	}
+}
+
+static void *_test_pair_thread(void *arg) {
+	const _test_pair_side_t *side = (const _test_pair_side_t *)arg;
+	_test_pair_run_t *run = side->run;
+	const _test_pair_t *pair = &run->test->pair;
+	const bool producer = side->producer;
+	const int core = pair->cores[!producer];
+	if (core >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (core < CPU_SETSIZE) CPU_SET(core, &set);
+		if (core >= CPU_SETSIZE
+		    || pthread_setaffinity_np(
+			    pthread_self(), sizeof(set), &set)) {
+			__atomic_store_n(
+				&run->failed, core + 1, __ATOMIC_RELEASE);
+		}
+	}
+	if (_test_perf.ctl >= 0) {
+		char comm[16];
+		_test_perf_comm(run->test, comm);
+		prctl(PR_SET_NAME, comm);
+	}
+	_test_pair_barrier(run, 2);
+	if (__atomic_load_n(&run->failed, __ATOMIC_ACQUIRE)) return NULL;
+
+	// Ping-pong: the producer hands one item over and waits for the
+	// consumer to say it got it. One-way latency is from before the
+	// producer's handoff to after the consumer's, round trip includes the
+	// reply.
+	for (size_t i = 0; i < run->warmup + run->rounds; i++) {
+		size_t spins = 0;
+		if (producer) {
+			const uint64_t start = _test_now();
+			__atomic_store_n(&run->sent, start, __ATOMIC_RELEASE);
+			pair->fn(true);
+			while (__atomic_load_n(&run->acked, __ATOMIC_ACQUIRE)
+			       <= i) {
+				_test_spin(&spins);
+			}
+			if (i < run->warmup) continue;
+			run->rtt[i - run->warmup] =
+				(double)(_test_now() - start);
+		} else {
+			pair->fn(false);
+			const uint64_t now = _test_now();
+			const uint64_t sent =
+				__atomic_load_n(&run->sent, __ATOMIC_ACQUIRE);
+			if (i >= run->warmup) {
+				run->oneway[i - run->warmup] =
+					(double)(now - sent);
+			}
+			__atomic_store_n(&run->acked, i + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	// Streaming: both sides go as fast as they can, timed by the consumer
+	_test_pair_barrier(run, 4);
+	if (producer) {
+		for (size_t i = 0; i < pair->iters; i++) pair->fn(true);
+	} else {
+		run->start = _test_now();
+		for (size_t i = 0; i < pair->iters; i++) pair->fn(false);
+		run->end = _test_now();
+	}
+	return NULL;
+}
+
+// Runs a pair benchmark on its two threads. One-way latency goes in the
+// test's stats so performance assertions check it.
+static void _test_pair_measure(_test_t *test) {
+	if (test->measured) return;
+	test->measured = true;
+	_test_pair_t *pair = &test->pair;
+	_test_pair_run_t run;
+	memset(&run, 0, sizeof(run));
+	run.test = test;
+	run.rounds = pair->iters < (1 << 20) ? pair->iters : (1 << 20);
+	if (!run.rounds) run.rounds = 1;
+	run.warmup = run.rounds / 16 < 1000 ? run.rounds / 16 : 1000;
+	run.oneway = (double *)malloc(run.rounds * sizeof(double));
+	run.rtt = (double *)malloc(run.rounds * sizeof(double));
+
+	_test_pair_side_t sides[2] = {{&run, true}, {&run, false}};
+	pthread_t threads[2];
+	int started = 0;
+	_test_perf_begin(test);
+	if (run.oneway && run.rtt) {
+		while (started < 2
+		       && !pthread_create(&threads[started],
+					  NULL,
+					  _test_pair_thread,
+					  &sides[started])) {
+			started++;
+		}
+	}
+	if (started == 1) {
+		// The other thread will never come, let this one go
+		__atomic_store_n(&run.failed, -1, __ATOMIC_RELEASE);
+		__atomic_fetch_add(&run.ready, 3, __ATOMIC_ACQ_REL);
+	}
+	for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+	_test_perf_end();
+
+	if (started < 2) {
+		test->skip = "couldn't start the threads";
+	} else if (run.failed) {
+		char *reason;
+		test->skip = asprintf(&reason,
+				      "can't pin a thread to core %d",
+				      run.failed - 1)
+				>= 0
+			? reason
+			: "can't pin the threads";
+	} else {
+		const size_t n = run.rounds;
+		_test_summarize(&test->stats, run.oneway, n);
+		_test_summarize(&pair->rtt, run.rtt, n);
+		test->stats.iters = pair->rtt.iters = n;
+		pair->oneway_p99 = run.oneway[n * 99 / 100];
+		pair->rtt_p99 = run.rtt[n * 99 / 100];
+		pair->item_ns = (double)(run.end - run.start)
+			/ (double)(pair->iters ? pair->iters : 1);
+	}
+	free(run.oneway);
+	free(run.rtt);
+}
+
+static void _test_bench_measure(_test_t *test) {
+	if (test->kind == _TEST_PAIR) _test_pair_measure(test);
+	else _test_bench_measure_all(&test, 1);
+}
+
+static _test_t *_test_bench_lookup(const char *name) {
+	for (int i = 0; i < _test_state->nbenches; i++) {
+		_test_t *test = _test_state->benches[i];
+		if (test->kind != _TEST_GROUP && !strcmp(test->name, name)) {
+			return test;
+		}
+	}
+	return NULL;
+}
+
+// Finds the benchmarks named in a group, the baseline first
+static int _test_group_members(
+	const _test_t *group, _test_t **members, bool report) {
+	int n = 0;
+	for (const char *name = group->group; *name && n < 64;) {
+		while (*name == ',' || *name == ' ') name++;
+		const size_t len = strcspn(name, ", ");
+		if (!len) break;
+
+		char buf[256];
+		snprintf(buf, sizeof(buf), "%.*s", (int)len, name);
+		name += len;
+		if (!(members[n] = _test_bench_lookup(buf))
+		    || members[n]->kind != _TEST_BENCH) {
+			if (!report) continue;
+			fprintf(stderr,
+				"%s benchmark named %s in group %s\n",
+				members[n] ? "can't group the pair" : "no",
+				buf,
+				group->name);
+			continue;
+		}
+		n++;
+	}
+	return n;
+}
+
+// Measures the benchmark along with everything in the groups it is in
+static void _test_bench_measure_groups(_test_t *test) {
+	for (int i = 0; i < _test_state->nbenches; i++) {
+		if (_test_state->benches[i]->kind != _TEST_GROUP) continue;
+		_test_t *members[64];
+		const int n = _test_group_members(
+			_test_state->benches[i], members, false);
+		for (int j = 0; j < n; j++) {
+			if (members[j] != test) continue;
+			_test_bench_measure_all(members, n);
+			break;
+		}
+	}
+	_test_bench_measure(test);
+}
+
+static _test_t *_test_bench_find(const char *name) {
+	_test_t *test = _test_bench_lookup(name);
+	if (test) {
+		_test_bench_measure_groups(test);
+		if (!test->skip) return test;
+		_test_msgf("Performance assertion failed: %s was skipped (%s).",
+			   name,
+			   test->skip);
+		return NULL;
+	}
+	_test_msgf("Performance assertion failed: no benchmark named %s.",
+		   name);
+	return NULL;
+}
+
+static inline bool _test_bench_below(const char *name, double ns) {
+	const _test_t *bench = _test_bench_find(name);
+	if (!bench) return false;
+	if (bench->stats.lo <= ns) return true;
+	_test_msgf("Performance assertion failed: %s median is %.2fns "
+		   "(95%% CI %.2f-%.2fns), over %.2fns.",
+		   name,
+		   bench->stats.median,
+		   bench->stats.lo,
+		   bench->stats.hi,
+		   ns);
+	return false;
+}
+
+static inline bool _test_bench_faster(
+	const char *fast, const char *slow, double by) {
+	const _test_t *a = _test_bench_find(fast);
+	if (!a) return false;
+	const _test_t *b = _test_bench_find(slow);
+	if (!b) return false;
+
+	// Largest speedup the two confidence intervals still allow
+	if (a->stats.lo <= 0.0 || b->stats.hi / a->stats.lo >= by) return true;
+	_test_msgf("Performance assertion failed: %s is %.2fx faster than %s "
+		   "(at most %.2fx), wanted %.2fx.",
+		   fast,
+		   b->stats.median / a->stats.median,
+		   slow,
+		   b->stats.hi / a->stats.lo,
+		   by);
+	return false;
+}
+
+static inline bool _test_bench_no_allocs(const char *name) {
+#ifndef _TEST_ALLOC_COUNT
+	(void)name;
+	_test_msgf("Performance assertion failed: allocation counting is not "
+		   "available in this build.");
+	return false;
+#else
+	const _test_t *bench = _test_bench_find(name);
+	if (!bench) return false;
+	if (bench->stats.allocs == 0.0) return true;
+	_test_msgf("Performance assertion failed: %s makes %.2f allocations "
+		   "per iter.",
+		   name,
+		   bench->stats.allocs);
+	return false;
+#endif
+}
+
+// Calls the event on every reporter that handles it
+#define _test_report(_event, ...)                                              \
+	for (int _r = 0; _r < _test_state->nreporters; _r++) {                 \
+		_test_reporter_t *_rep = &_test_state->reporters[_r];          \
+		if (_rep->_event) _rep->_event(_rep, __VA_ARGS__);             \
+	}
+
+static void _test_print_time(FILE *out, double ns) {
+	if (ns < 1000.0) fprintf(out, "%6.2fns", ns);
+	else if (ns < 1000000.0) fprintf(out, "%6.2fus", ns / 1000.0);
+	else if (ns < 1000000000.0) fprintf(out, "%6.2fms", ns / 1000000.0);
+	else fprintf(out, "%6.2fs ", ns / 1000000000.0);
+}
+
+static void _test_console_test(
+	_test_reporter_t *rep, const _test_result_t *result) {
+	fprintf(rep->out,
+		"%s\x1B[0m %s",
+		!result->line ? "\x1B[32m[PASS]" : "\x1B[31m[FAIL]",
+		result->test->name);
+	if (result->line) fprintf(rep->out, " (on line %d)", result->line);
+	if (result->test->arena_peak) {
+		fprintf(rep->out, " (arena peak ");
+		_test_print_bytes(rep->out, result->test->arena_peak);
+		fprintf(rep->out, ")");
+	}
+	fprintf(rep->out, "\n");
+	if (result->line && *result->msg) {
+		fprintf(rep->out, " %s\n", result->msg);
+	}
+}
+
+// GB/s the benchmark reads its elements at, or 0 if it doesn't run over an
+// array or the machine wasn't characterized to compare it with. File
+// benchmarks read through the kernel, their bytes counter is the throughput.
+static double _test_bench_gbps(const _test_t *test) {
+	const _test_bench_t *bench = &test->bench;
+	if (!_test_state->machine.measured || test->kind != _TEST_BENCH
+	    || bench->path || bench->filesize || !bench->step
+	    || test->stats.median <= 0.0) {
+		return 0.0;
+	}
+	return (double)bench->step / test->stats.median;
+}
+
+// A counter's average per iteration and per second of timed run
+static double _test_counter_per_iter(const _test_t *test, int i) {
+	const double iters = (double)test->stats.iters;
+	return iters > 0.0 ? test->counters[i].total / iters : 0.0;
+}
+
+static double _test_counter_per_sec(const _test_t *test, int i) {
+	const double ns = test->stats.mean * (double)test->stats.iters;
+	return ns > 0.0 ? test->counters[i].total / ns * 1e9 : 0.0;
+}
+
+static void _test_print_count(FILE *out, double n) {
+	const double abs = n < 0.0 ? -n : n;
+	if (abs < 1e3) fprintf(out, "%.3g", n);
+	else if (abs < 1e6) fprintf(out, "%.3gK", n / 1e3);
+	else if (abs < 1e9) fprintf(out, "%.3gM", n / 1e6);
+	else fprintf(out, "%.3gG", n / 1e9);
+}
+
+static const char *const _test_levels[] = {"L1", "L2", "L3", "memory"};
+
+static void _test_console_machine(
+	_test_reporter_t *rep, const _test_machine_t *machine) {
+	FILE *out = rep->out;
+	if (!rep->n++) fprintf(out, "\n");
+	fprintf(out,
+		"\x1B[34m[MACHINE]\x1B[0m %d cpus, reading the clock takes "
+		"%.1fns (resolution %.0fns)\n",
+		machine->ncpus,
+		machine->timer_ns,
+		machine->timer_res_ns);
+	for (int i = 0; i < 4; i++) {
+		fprintf(out,
+			"  %-6s %8zuK load latency ",
+			_test_levels[i],
+			machine->sizes[i] >> 10);
+		_test_print_time(out, machine->latency[i]);
+		fprintf(out, "\n");
+	}
+	fprintf(out,
+		"  bandwidth %.2f GB/s on one core, %.2f GB/s on all\n",
+		machine->bw_single,
+		machine->bw_all);
+}
+
+static void _test_console_latency(
+	FILE *out, const char *what, const _test_stats_t *stats, double p99) {
+	fprintf(out, "  %-11s median ", what);
+	_test_print_time(out, stats->median);
+	fprintf(out, " [");
+	_test_print_time(out, stats->lo);
+	fprintf(out, " - ");
+	_test_print_time(out, stats->hi);
+	fprintf(out, "], p99 ");
+	_test_print_time(out, p99);
+	fprintf(out, ", max ");
+	_test_print_time(out, stats->max);
+	fprintf(out, "\n");
+}
+
+static void _test_console_pair(FILE *out, const _test_t *test) {
+	const _test_pair_t *pair = &test->pair;
+	fprintf(out,
+		"\x1B[34m[PAIR]\x1B[0m %s (%zu round trips, %zu streamed, "
+		"cores %d -> %d)\n",
+		test->name,
+		test->stats.iters,
+		pair->iters,
+		pair->cores[0],
+		pair->cores[1]);
+	_test_console_latency(out, "one-way", &test->stats, pair->oneway_p99);
+	_test_console_latency(out, "round trip", &pair->rtt, pair->rtt_p99);
+	fprintf(out, "  %-11s ", "streaming");
+	_test_print_time(out, pair->item_ns);
+	fprintf(out,
+		" per item (%.2fM items/s)\n",
+		pair->item_ns > 0.0 ? 1e3 / pair->item_ns : 0.0);
+}
+
+static void _test_console_bench(_test_reporter_t *rep, const _test_t *test) {
+	FILE *out = rep->out;
+	if (!rep->n++) fprintf(out, "\n");
+	if (test->skip) {
+		fprintf(out,
+			"\x1B[33m[SKIP]\x1B[0m %s (%s)\n",
+			test->name,
+			test->skip);
+		return;
+	}
+	if (test->kind == _TEST_PAIR) {
+		_test_console_pair(out, test);
+		return;
+	}
+	const _test_stats_t *stats = &test->stats;
+	fprintf(out,
+		"\x1B[34m[RAN]\x1B[0m %s (%-8zd iters) in ",
+		test->name,
+		stats->iters);
+	_test_print_time(out, stats->mean * (double)stats->iters);
+	fprintf(out, " (");
+	_test_print_time(out, stats->mean);
+	fprintf(out, " per iter, median ");
+	_test_print_time(out, stats->median);
+	fprintf(out, " [");
+	_test_print_time(out, stats->lo);
+	fprintf(out, " - ");
+	_test_print_time(out, stats->hi);
+	fprintf(out, "]");
+	if (stats->allocs > 0.0) {
+		fprintf(out, ", %.2f allocs/iter", stats->allocs);
+	}
+	const double gbps = _test_bench_gbps(test);
+	if (gbps > 0.0 && _test_state->machine.bw_single > 0.0) {
+		fprintf(out,
+			", %.2f GB/s, %.0f%% of bandwidth",
+			gbps,
+			gbps / _test_state->machine.bw_single * 100.0);
+	}
+	const char *backing = _test_bench_backing(test);
+	if (backing) fprintf(out, ", on %s", backing);
+	if (test->arena_peak) {
+		fprintf(out, ", arena peak ");
+		_test_print_bytes(out, test->arena_peak);
+	}
+	fprintf(out, ")\n");
+	for (int i = 0; i < test->ncounters; i++) {
+		fprintf(out, "  %-16s ", test->counters[i].name);
+		_test_print_count(out, test->counters[i].total);
+		fprintf(out, " total, ");
+		_test_print_count(out, _test_counter_per_iter(test, i));
+		fprintf(out, " per iter, ");
+		_test_print_count(out, _test_counter_per_sec(test, i));
+		fprintf(out, "/s\n");
+	}
+}
+
+// Whether two benchmarks run over the same input. Prepared inputs are gone
+// by the time groups are reported, so those are compared by what was noted
+// about them: the generated data's hash, the corpus file or the fixture type
+// (its prepare function).
+static bool _test_bench_same_input(
+	const _test_bench_t *a, const _test_bench_t *b) {
+	if (a->nitems != b->nitems || a->step != b->step) return false;
+	if (!a->prepare && !b->prepare) return a->array == b->array;
+	if (a->prepare != b->prepare || a->input != b->input
+	    || a->format != b->format || a->filesize != b->filesize
+	    || a->fileflags != b->fileflags) {
+		return false;
+	}
+	return !a->path || !b->path ? a->path == b->path
+				    : !strcmp(a->path, b->path);
+}
+
+static void _test_console_group(
+	_test_reporter_t *rep, const _test_t *group, _test_t **members, int n) {
+	FILE *out = rep->out;
+	if (!rep->n++) fprintf(out, "\n");
+	fprintf(out,
+		"\x1B[34m[GROUP]\x1B[0m %s (baseline %s)\n",
+		group->name,
+		members[0]->name);
+	const _test_stats_t *base = &members[0]->stats;
+	bool same_input = true;
+	for (int i = 0; i < n; i++) {
+		const _test_bench_t *bench = &members[i]->bench;
+		const _test_stats_t *stats = &members[i]->stats;
+		if (members[i]->skip) {
+			fprintf(out,
+				"  %-24s skipped (%s)\n",
+				members[i]->name,
+				members[i]->skip);
+			continue;
+		}
+		same_input &=
+			_test_bench_same_input(bench, &members[0]->bench);
+
+		fprintf(out, "  %-24s ", members[i]->name);
+		_test_print_time(out, stats->median);
+		fprintf(out,
+			" %6.2fx [%6.2fx - %6.2fx]\n",
+			base->median / stats->median,
+			base->lo / stats->hi,
+			base->hi / stats->lo);
+	}
+	if (!same_input) {
+		fprintf(out, "  (members don't run over the same input)\n");
+	}
+}
+
+static void _test_console_start(
+	_test_reporter_t *rep, const struct _test_state *state) {
+	if (!state->shuffle) return;
+	fprintf(rep->out,
+		"Benchmarks shuffled with seed %llu\n",
+		(unsigned long long)state->seed);
+}
+
+static void _test_console_end(
+	_test_reporter_t *rep, const struct _test_state *state) {
+	if (rep->n) fprintf(rep->out, "\n");
+	fprintf(rep->out, "%d/%d tests passed\n", state->passed, state->ran);
+}
+
+static void _test_tap_start(
+	_test_reporter_t *rep, const struct _test_state *state) {
+	fprintf(rep->out, "TAP version 13\n1..%d\n", state->nrun);
+	if (state->shuffle) {
+		fprintf(rep->out,
+			"# benchmarks shuffled with seed %llu\n",
+			(unsigned long long)state->seed);
+	}
+}
+
+static void _test_tap_test(
+	_test_reporter_t *rep, const _test_result_t *result) {
+	fprintf(rep->out,
+		"%sok %zu - %s\n",
+		result->line ? "not " : "",
+		++rep->n,
+		result->test->name);
+	if (result->test->arena_peak) {
+		fprintf(rep->out,
+			"# arena peak %zu bytes\n",
+			result->test->arena_peak);
+	}
+	if (!result->line) return;
+	fprintf(rep->out, "# on line %d\n", result->line);
+	if (*result->msg) fprintf(rep->out, "# %s\n", result->msg);
+}
+
+static void _test_tap_bench(_test_reporter_t *rep, const _test_t *test) {
+	if (test->skip) {
+		fprintf(rep->out,
+			"# bench %s: skipped (%s)\n",
+			test->name,
+			test->skip);
+		return;
+	}
+	if (test->kind == _TEST_PAIR) {
+		fprintf(rep->out,
+			"# pair %s: one-way median %.2fns (p99 %.2fns), "
+			"round trip median %.2fns (p99 %.2fns), "
+			"%.2fns/item streaming\n",
+			test->name,
+			test->stats.median,
+			test->pair.oneway_p99,
+			test->pair.rtt.median,
+			test->pair.rtt_p99,
+			test->pair.item_ns);
+		return;
+	}
+	fprintf(rep->out,
+		"# bench %s: %zu iters, median %.2fns/iter "
+		"(95%% CI %.2f-%.2fns), mean %.2fns/iter, %.2f allocs/iter\n",
+		test->name,
+		test->stats.iters,
+		test->stats.median,
+		test->stats.lo,
+		test->stats.hi,
+		test->stats.mean,
+		test->stats.allocs);
+	const char *backing = _test_bench_backing(test);
+	if (backing) {
+		fprintf(rep->out, "# bench %s: on %s\n", test->name, backing);
+	}
+	if (test->arena_peak) {
+		fprintf(rep->out,
+			"# bench %s: arena peak %zu bytes\n",
+			test->name,
+			test->arena_peak);
+	}
+	for (int i = 0; i < test->ncounters; i++) {
+		fprintf(rep->out,
+			"# bench %s: %s %.6g total, %.6g/iter, %.6g/s\n",
+			test->name,
+			test->counters[i].name,
+			test->counters[i].total,
+			_test_counter_per_iter(test, i),
+			_test_counter_per_sec(test, i));
+	}
+}
+
+static void _test_tap_machine(
+	_test_reporter_t *rep, const _test_machine_t *machine) {
+	fprintf(rep->out,
+		"# machine: %d cpus, clock %.1fns (resolution %.0fns), "
+		"bandwidth %.2f GB/s one core, %.2f GB/s all cores\n",
+		machine->ncpus,
+		machine->timer_ns,
+		machine->timer_res_ns,
+		machine->bw_single,
+		machine->bw_all);
+	for (int i = 0; i < 4; i++) {
+		fprintf(rep->out,
+			"# machine: %s (%zuK) load latency %.2fns\n",
+			_test_levels[i],
+			machine->sizes[i] >> 10,
+			machine->latency[i]);
+	}
+}
+
+static void _test_tap_group(
+	_test_reporter_t *rep, const _test_t *group, _test_t **members, int n) {
+	const _test_stats_t *base = &members[0]->stats;
+	for (int i = 0; i < n; i++) {
+		if (members[i]->skip) continue;
+		const _test_stats_t *stats = &members[i]->stats;
+		fprintf(rep->out,
+			"# group %s: %s %.2fx over %s (95%% CI %.2f-%.2fx)\n",
+			group->name,
+			members[i]->name,
+			base->median / stats->median,
+			members[0]->name,
+			base->lo / stats->hi,
+			base->hi / stats->lo);
+	}
+}
+
+static void _test_xml(FILE *out, const char *str) {
+	for (; *str; str++) {
+		switch (*str) {
+		case '<': fputs("&lt;", out); break;
+		case '>': fputs("&gt;", out); break;
+		case '&': fputs("&amp;", out); break;
+		case '"': fputs("&quot;", out); break;
+		default: fputc(*str, out); break;
+		}
+	}
+}
+
+static void _test_junit_start(
+	_test_reporter_t *rep, const struct _test_state *state) {
+	rep->cases = open_memstream(&rep->cases_buf, &rep->cases_len);
+	rep->props = open_memstream(&rep->props_buf, &rep->props_len);
+	if (state->shuffle) {
+		fprintf(rep->props,
+			"      <property name=\"shuffle.seed\" "
+			"value=\"%llu\"/>\n",
+			(unsigned long long)state->seed);
+	}
+}
+
+static void _test_junit_test(
+	_test_reporter_t *rep, const _test_result_t *result) {
+	rep->n++;
+	fprintf(rep->cases, "    <testcase classname=\"test\" name=\"");
+	_test_xml(rep->cases, result->test->name);
+	fprintf(rep->cases, "\" time=\"%.6f\"", result->secs);
+	if (!result->line) {
+		fprintf(rep->cases, "/>\n");
+		return;
+	}
+	fprintf(rep->cases,
+		">\n      <failure message=\"on line %d",
+		result->line);
+	if (*result->msg) fprintf(rep->cases, ": ");
+	_test_xml(rep->cases, result->msg);
+	fprintf(rep->cases, "\"/>\n    </testcase>\n");
+}
+
+static void _test_junit_prop(
+	_test_reporter_t *rep, const char *name, const char *key, double val) {
+	fprintf(rep->props, "      <property name=\"");
+	_test_xml(rep->props, name);
+	fprintf(rep->props, ".");
+	_test_xml(rep->props, key);
+	fprintf(rep->props, "\" value=\"%.6g\"/>\n", val);
+}
+
+static void _test_junit_bench(_test_reporter_t *rep, const _test_t *test) {
+	const _test_stats_t *stats = &test->stats;
+	rep->n++;
+	fprintf(rep->cases, "    <testcase classname=\"bench\" name=\"");
+	_test_xml(rep->cases, test->name);
+	if (test->skip) {
+		fprintf(rep->cases,
+			"\" time=\"0\">\n      <skipped message=\"");
+		_test_xml(rep->cases, test->skip);
+		fprintf(rep->cases, "\"/>\n    </testcase>\n");
+		return;
+	}
+	fprintf(rep->cases,
+		"\" time=\"%.6f\"/>\n",
+		stats->mean * (double)stats->iters / 1e9);
+
+	char name[256];
+	snprintf(name, sizeof(name), "bench.%s", test->name);
+	if (test->kind == _TEST_PAIR) {
+		const _test_pair_t *pair = &test->pair;
+		_test_junit_prop(rep, name, "oneway_median_ns", stats->median);
+		_test_junit_prop(rep, name, "oneway_p99_ns", pair->oneway_p99);
+		_test_junit_prop(rep, name, "rtt_median_ns", pair->rtt.median);
+		_test_junit_prop(rep, name, "rtt_p99_ns", pair->rtt_p99);
+		_test_junit_prop(rep, name, "item_ns", pair->item_ns);
+		return;
+	}
+	_test_junit_prop(rep, name, "iters", (double)stats->iters);
+	_test_junit_prop(rep, name, "mean_ns", stats->mean);
+	_test_junit_prop(rep, name, "median_ns", stats->median);
+	_test_junit_prop(rep, name, "ci_lo_ns", stats->lo);
+	_test_junit_prop(rep, name, "ci_hi_ns", stats->hi);
+	_test_junit_prop(rep, name, "allocs", stats->allocs);
+	const double gbps = _test_bench_gbps(test);
+	if (gbps > 0.0) _test_junit_prop(rep, name, "gbps", gbps);
+	if (_test_bench_backing(test)) {
+		_test_junit_prop(
+			rep, name, "huge_page_bytes", (double)test->bench.huge);
+	}
+	if (test->arena_peak) {
+		_test_junit_prop(rep,
+				 name,
+				 "arena_peak_bytes",
+				 (double)test->arena_peak);
+	}
+	for (int i = 0; i < test->ncounters; i++) {
+		char key[128];
+		const char *counter = test->counters[i].name;
+		snprintf(key, sizeof(key), "%s.total", counter);
+		_test_junit_prop(rep, name, key, test->counters[i].total);
+		snprintf(key, sizeof(key), "%s.per_iter", counter);
+		_test_junit_prop(
+			rep, name, key, _test_counter_per_iter(test, i));
+		snprintf(key, sizeof(key), "%s.per_sec", counter);
+		_test_junit_prop(
+			rep, name, key, _test_counter_per_sec(test, i));
+	}
+}
+
+static void _test_junit_machine(
+	_test_reporter_t *rep, const _test_machine_t *machine) {
+	for (int i = 0; i < 4; i++) {
+		char key[64];
+		snprintf(key, sizeof(key), "%s_bytes", _test_levels[i]);
+		_test_junit_prop(
+			rep, "machine", key, (double)machine->sizes[i]);
+		snprintf(key, sizeof(key), "%s_latency_ns", _test_levels[i]);
+		_test_junit_prop(rep, "machine", key, machine->latency[i]);
+	}
+	_test_junit_prop(rep, "machine", "cpus", machine->ncpus);
+	_test_junit_prop(rep, "machine", "bw_single_gbps", machine->bw_single);
+	_test_junit_prop(rep, "machine", "bw_all_gbps", machine->bw_all);
+	_test_junit_prop(rep, "machine", "timer_ns", machine->timer_ns);
+}
+
+static void _test_junit_group(
+	_test_reporter_t *rep, const _test_t *group, _test_t **members, int n) {
+	for (int i = 0; i < n; i++) {
+		if (members[i]->skip) continue;
+		char name[256];
+		snprintf(name,
+			 sizeof(name),
+			 "group.%s.%s",
+			 group->name,
+			 members[i]->name);
+		_test_junit_prop(rep,
+				 name,
+				 "speedup",
+				 members[0]->stats.median
+					 / members[i]->stats.median);
+	}
+}
+
+static void _test_junit_end(
+	_test_reporter_t *rep, const struct _test_state *state) {
+	fclose(rep->cases);
+	fclose(rep->props);
+	fprintf(rep->out,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<testsuites>\n  <testsuite name=\"");
+	_test_xml(rep->out, state->progname);
+	fprintf(rep->out,
+		"\" tests=\"%zu\" failures=\"%d\" time=\"%.6f\">\n",
+		rep->n,
+		state->ran - state->passed,
+		(double)(_test_now() - state->start) / 1e9);
+	if (rep->props_len) {
+		fprintf(rep->out,
+			"    <properties>\n%s    </properties>\n",
+			rep->props_buf);
+	}
+	fputs(rep->cases_buf, rep->out);
+	fprintf(rep->out, "  </testsuite>\n</testsuites>\n");
+	free(rep->cases_buf);
+	free(rep->props_buf);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+static const _test_reporter_t _test_console = {
+	.start = _test_console_start,
+	.result = _test_console_test,
+	.bench = _test_console_bench,
+	.group = _test_console_group,
+	.machine = _test_console_machine,
+	.end = _test_console_end,
+};
+static const _test_reporter_t _test_tap = {
+	.start = _test_tap_start,
+	.result = _test_tap_test,
+	.bench = _test_tap_bench,
+	.group = _test_tap_group,
+	.machine = _test_tap_machine,
+};
+static const _test_reporter_t _test_junit = {
+	.start = _test_junit_start,
+	.result = _test_junit_test,
+	.bench = _test_junit_bench,
+	.group = _test_junit_group,
+	.machine = _test_junit_machine,
+	.end = _test_junit_end,
+};
+#pragma GCC diagnostic pop
+
+// Adds a reporter writing to path, or stdout if path is NULL. Output is
+// fully buffered unless it's going to a terminal.
+static bool _test_add_reporter(_test_state_t *state,
+			       const _test_reporter_t *reporter,
+			       const char *path) {
+	if (state->nreporters == 4) return false;
+	FILE *out = path ? fopen(path, "w") : stdout;
+	if (!out) {
+		fprintf(stderr, "%s: can't open %s\n", state->progname, path);
+		return false;
+	}
+	if (path || !isatty(STDOUT_FILENO)) setvbuf(out, NULL, _IOFBF, 1 << 16);
+	_test_reporter_t *rep = &state->reporters[state->nreporters++];
+	*rep = *reporter;
+	rep->out = out;
+	return true;
+}
+
+// Returns the value of an --opt=value argument ("" for a plain --opt) or NULL
+// if arg is some other option
+static const char *_test_opt(const char *arg, const char *opt) {
+	const size_t len = strlen(opt);
+	if (strncmp(arg, opt, len)) return NULL;
+	if (arg[len] == '=') return arg + len + 1;
+	return arg[len] ? NULL : "";
+}
+
+static const char _test_usage[] =
+	"[--tap[=file]] [--junit=file] [--profile[=dir]]\n"
+	"\t[--perf-ctl=fifo[,ack-fifo]] [--machine] [--shuffle[=seed]]\n"
+	"\t[--pages=small|huge|hugetlb] [--cache=file | --no-cache]\n"
+	"\t[--failed-first] [--only-failed] [--fastest-first]\n"
+	"\t[--arena-poison] [--history[=file]] [--history-report=html]\n"
+	"\t[--compare=[a,]b] [--layouts=n [--seed=n]]\n"
+	"\t[--stress=name[,name...] [--jobs=n]\n"
+	"\t [--stress-time=secs | --stress-count=n]]\n"
+	"\t[--fuzz=name [--fuzz-time=secs] [--jobs=n] [--corpus=dir]\n"
+	"\t [--max-len=n] [--seed=n]]\n";
+
+static inline bool _test_parse_args(
+	_test_state_t *state, int argc, char **argv) {
+	bool console = true;
+	const char *val;
+	for (int i = 1; i < argc; i++) {
+		if ((val = _test_opt(argv[i], "--tap"))) {
+			if (!*val) console = false;
+			if (!_test_add_reporter(
+				    state, &_test_tap, *val ? val : NULL)) {
+				return false;
+			}
+		} else if ((val = _test_opt(argv[i], "--junit")) && *val) {
+			if (!_test_add_reporter(state, &_test_junit, val)) {
+				return false;
+			}
+		} else if ((val = _test_opt(argv[i], "--fuzz")) && *val) {
+			state->fuzz = val;
+		} else if ((val = _test_opt(argv[i], "--fuzz-time")) && *val) {
+			state->fuzz_time = strtod(val, NULL);
+		} else if ((val = _test_opt(argv[i], "--stress")) && *val) {
+			state->stress = val;
+		} else if ((val = _test_opt(argv[i], "--stress-time"))
+			   && *val) {
+			state->stress_time = strtod(val, NULL);
+		} else if ((val = _test_opt(argv[i], "--stress-count"))
+			   && *val) {
+			state->stress_count = strtoull(val, NULL, 10);
+		} else if ((val = _test_opt(argv[i], "--jobs")) && *val) {
+			state->jobs = atoi(val);
+			if (state->jobs < 1) state->jobs = 1;
+			if (state->jobs > 64) state->jobs = 64;
+		} else if ((val = _test_opt(argv[i], "--corpus")) && *val) {
+			state->corpus = val;
+		} else if ((val = _test_opt(argv[i], "--max-len")) && *val) {
+			state->max_len = strtoull(val, NULL, 10);
+		} else if ((val = _test_opt(argv[i], "--seed")) && *val) {
+			state->seed = strtoull(val, NULL, 10);
+		} else if ((val = _test_opt(argv[i], "--profile"))) {
+			state->profile = *val ? val : "profile";
+		} else if ((val = _test_opt(argv[i], "--perf-ctl")) && *val) {
+			state->perf_ctl = val;
+		} else if ((val = _test_opt(argv[i], "--machine")) && !*val) {
+			state->characterize = true;
+		} else if ((val = _test_opt(argv[i], "--shuffle"))) {
+			state->shuffle = true;
+			if (*val) state->seed = strtoull(val, NULL, 10);
+		} else if ((val = _test_opt(argv[i], "--pages"))
+			   && (!strcmp(val, "small") || !strcmp(val, "huge")
+			       || !strcmp(val, "hugetlb"))) {
+			state->pages = !strcmp(val, "huge") ? TEST_PAGES_HUGE
+				: !strcmp(val, "hugetlb")   ? TEST_PAGES_HUGETLB
+							    : TEST_PAGES_SMALL;
+		} else if ((val = _test_opt(argv[i], "--arena-poison"))
+			   && !*val) {
+			state->arena_poison = true;
+		} else if ((val = _test_opt(argv[i], "--history"))) {
+			state->history = val;
+		} else if ((val = _test_opt(argv[i], "--history-report"))
+			   && *val) {
+			state->history_report = val;
+		} else if ((val = _test_opt(argv[i], "--compare")) && *val) {
+			state->compare = val;
+		} else if ((val = _test_opt(argv[i], "--layouts")) && *val) {
+			state->layouts = atoi(val);
+			if (state->layouts < 2) state->layouts = 2;
+			if (state->layouts > 64) state->layouts = 64;
+		} else if ((val = _test_opt(argv[i], "--worker")) && *val) {
+			state->worker = atoi(val);
+		} else if ((val = _test_opt(argv[i], "--cache")) && *val) {
+			state->cache = val;
+		} else if ((val = _test_opt(argv[i], "--no-cache")) && !*val) {
+			state->cache = NULL;
+		} else if ((val = _test_opt(argv[i], "--failed-first"))
+			   && !*val) {
+			state->failed_first = true;
+		} else if ((val = _test_opt(argv[i], "--only-failed"))
+			   && !*val) {
+			state->only_failed = true;
+		} else if ((val = _test_opt(argv[i], "--fastest-first"))
+			   && !*val) {
+			state->fastest_first = true;
+		} else {
+			fprintf(stderr,
+				"%s: unknown option %s\nusage: %s %s",
+				state->progname,
+				argv[i],
+				state->progname,
+				_test_usage);
+			return false;
+		}
+	}
+	state->rng = state->seed ? state->seed : 1;
+
+	// The history is in <program>.history unless given
+	static char history[256];
+	if (state->history_report && !state->history) state->history = "";
+	if (state->history && !*state->history) {
+		snprintf(history,
+			 sizeof(history),
+			 "%s.history",
+			 state->progname);
+		state->history = history;
+	}
+	if (state->profile && !_test_prof_start()) return false;
+	if (!_test_perf_start(state->perf_ctl)) return false;
+	return !console || _test_add_reporter(state, &_test_console, NULL);
+}
+
+// Result cache. The outcome and duration of every test are kept between runs
+// so the ones that failed last time can be run first, or alone, and the
+// suite can start with the fastest tests.
+static inline void _test_cache_load(_test_state_t *state) {
+	FILE *file = state->cache ? fopen(state->cache, "r") : NULL;
+	if (!file) return;
+	char line[512], name[480], status;
+	double secs;
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%c %lf %479[^\n]", &status, &secs, name)
+		    != 3) {
+			continue;
+		}
+		for (int i = 0; i < state->ntests; i++) {
+			_test_t *test = state->tests[i];
+			if (strcmp(test->name, name)) continue;
+			test->cached = true;
+			test->failed = status == 'F';
+			test->secs = secs;
+		}
+	}
+	fclose(file);
+}
+
+static inline void _test_cache_save(const _test_state_t *state) {
+	FILE *file = state->cache ? fopen(state->cache, "w") : NULL;
+	if (!file) return;
+	for (int i = 0; i < state->ntests; i++) {
+		const _test_t *test = state->tests[i];
+		if (!test->cached) continue;
+		fprintf(file,
+			"%c %.6f %s\n",
+			test->failed ? 'F' : 'P',
+			test->secs,
+			test->name);
+	}
+	fclose(file);
+}
+
+// Whether a runs before b: failures first with --failed-first (and tests
+// without a cached result, which are probably new), then the fastest
+static bool _test_cache_before(
+	const _test_state_t *state, const _test_t *a, const _test_t *b) {
+	if (state->only_failed && a->failed != b->failed) return a->failed;
+	if (state->failed_first) {
+		const bool fa = a->failed || !a->cached;
+		const bool fb = b->failed || !b->cached;
+		if (fa != fb) return fa;
+	}
+	return state->fastest_first && a->secs < b->secs;
+}
+
+// Reorders the tests (stably) by their cached results and returns how many
+// of them to run. With --only-failed that's the failures, if there were any.
+static inline int _test_cache_order(_test_state_t *state) {
+	_test_t **tests = state->tests;
+	int failed = 0;
+	for (int i = 1; i < state->ntests; i++) {
+		_test_t *test = tests[i];
+		int j = i;
+		while (j && _test_cache_before(state, test, tests[j - 1])) {
+			tests[j] = tests[j - 1], j--;
+		}
+		tests[j] = test;
+	}
+	for (int i = 0; i < state->ntests; i++) failed += tests[i]->failed;
+	if (!state->only_failed) return state->ntests;
+	if (failed) return failed;
+	fprintf(stderr, "no cached failures, running everything\n");
+	return state->ntests;
+}
+
+// Makes sure buffered results aren't lost when a test crashes
+static inline void _test_crash(int sig) {
+	_test_t *test = _test_state->current;
+	if (test) {
+		fprintf(stderr, "%s crashed with signal %d\n", test->name, sig);
+		if (test->kind == _TEST_TEST || test->kind == _TEST_FUZZ
+		    || test->kind == _TEST_CASES) {
+			test->cached = test->failed = true;
+			_test_cache_save(_test_state);
+		}
+	}
+	for (int i = 0; i < _test_state->nreporters; i++) {
+		fflush(_test_state->reporters[i].out);
+	}
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+// Fuzzing. Targets replay their corpus (and an empty input) as regular tests
+// and are fuzzed with --fuzz=name. The fuzz loop runs in forked workers so
+// the parent can report progress and minimize whatever input crashes them.
+// Building with -fsanitize-coverage=trace-pc-guard (trace-pc on GCC) gives the
+// mutator coverage to keep interesting inputs with.
+typedef struct _test_input {
+	uint8_t *data;
+	size_t size;
+} _test_input_t;
+
+typedef struct _test_fuzz_shared {
+	uint64_t execs[64];
+	uint32_t corpus, edges;
+	int crashed;
+	char crash[512], msg[1100];
+} _test_fuzz_shared_t;
+
+static uint32_t _test_cov_edges, _test_cov_new;
+
+#ifndef TEST_LIBFUZZER
+_TEST_C void __sanitizer_cov_trace_pc_guard_init(
+	uint32_t *start, uint32_t *stop) {
+	if (start == stop || *start) return;
+	for (uint32_t *guard = start; guard < stop; guard++) {
+		*guard = ++_test_cov_edges;
+	}
+}
+
+// Each guard only needs to be seen once, so it is turned off after that
+_TEST_C void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
+	if (!*guard) return;
+	*guard = 0;
+	_test_cov_new++;
+}
+
+// GCC only has -fsanitize-coverage=trace-pc, which hashes the caller's pc
+// into a bitmap instead
+_TEST_C
+# ifdef __has_attribute
+#  if __has_attribute(no_sanitize_coverage)
+__attribute__((no_sanitize_coverage))
+#  endif
+# endif
+void __sanitizer_cov_trace_pc(void) {
+	static uint64_t seen[1 << 12];
+	const uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+	const size_t bit = (pc ^ pc >> 18) & ((1 << 18) - 1);
+	if (seen[bit / 64] & (uint64_t)1 << bit % 64) return;
+	seen[bit / 64] |= (uint64_t)1 << bit % 64;
+	_test_cov_new++;
+}
+#endif
+
+static struct {
+	_test_fuzz_shared_t *shared;
+	const uint8_t *data;
+	size_t size;
+	char dir[512];
+} _test_fuzz_cur;
+
+static uint64_t _test_hash(const uint8_t *data, size_t size) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static uint8_t *_test_read_file(const char *path, size_t *size) {
+	FILE *file = fopen(path, "rb");
+	if (!file) return NULL;
+	fseek(file, 0, SEEK_END);
+	const long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	uint8_t *data = (uint8_t *)malloc(len > 0 ? (size_t)len : 1);
+	*size = data && len > 0 ? fread(data, 1, (size_t)len, file) : 0;
+	fclose(file);
+	return data;
+}
+
+// Only uses what is safe to call from a signal handler
+static void _test_write_input(
+	char *path, size_t len, const char *prefix, const uint8_t *data,
+	size_t size) {
+	snprintf(path,
+		 len,
+		 "%s/%s%016llx",
+		 _test_fuzz_cur.dir,
+		 prefix,
+		 (unsigned long long)_test_hash(data, size));
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return;
+	for (size_t off = 0; off < size;) {
+		const ssize_t n = write(fd, data + off, size - off);
+		if (n <= 0) break;
+		off += (size_t)n;
+	}
+	close(fd);
+}
+
+static void _test_fuzz_dir(const _test_state_t *state, const _test_t *test) {
+	const char *root = state->corpus ? state->corpus : "corpus";
+	snprintf(_test_fuzz_cur.dir,
+		 sizeof(_test_fuzz_cur.dir),
+		 "%s/%s",
+		 root,
+		 test->name);
+}
+
+// Loads every file in the target's corpus directory after an empty input
+static size_t _test_fuzz_load(_test_input_t **inputs) {
+	size_t n = 1, cap = 16;
+	*inputs = (_test_input_t *)calloc(cap, sizeof(_test_input_t));
+	(*inputs)[0].data = (uint8_t *)malloc(1);
+	DIR *dir = opendir(_test_fuzz_cur.dir);
+	if (!dir) return n;
+	for (struct dirent *ent; (ent = readdir(dir));) {
+		if (ent->d_name[0] == '.') continue;
+		char path[1024];
+		snprintf(path,
+			 sizeof(path),
+			 "%s/%s",
+			 _test_fuzz_cur.dir,
+			 ent->d_name);
+		size_t size;
+		uint8_t *data = _test_read_file(path, &size);
+		if (!data) continue;
+		if (n == cap) {
+			cap *= 2;
+			*inputs = (_test_input_t *)realloc(
+				*inputs, cap * sizeof(_test_input_t));
+		}
+		(*inputs)[n].data = data, (*inputs)[n++].size = size;
+	}
+	closedir(dir);
+	return n;
+}
+
+static void _test_fuzz_free(_test_input_t *inputs, size_t n) {
+	for (size_t i = 0; i < n; i++) free(inputs[i].data);
+	free(inputs);
+}
+
+// Runs the target over its corpus as a regular test
+static int _test_fuzz_replay(_test_t *test) {
+	_test_fuzz_dir(_test_state, test);
+	_test_input_t *inputs;
+	const size_t n = _test_fuzz_load(&inputs);
+	int fail_line = 0;
+	for (size_t i = 0; i < n && !fail_line; i++) {
+		fail_line = test->fuzzfn(inputs[i].data, inputs[i].size);
+		_test_arena_rewind(0);
+		if (fail_line) {
+			_test_msgf(" (input %zu of %zu, %zu bytes)",
+				   i + 1,
+				   n,
+				   inputs[i].size);
+		}
+	}
+	_test_fuzz_free(inputs, n);
+	return fail_line;
+}
+
+static size_t _test_mutate(
+	uint8_t *buf, size_t size, size_t max, const _test_input_t *inputs,
+	size_t ninputs, uint64_t *rng) {
+	static const uint32_t interesting[] = {
+		0, 1, 0x7f, 0x80, 0xff, 0x7fff, 0x8000, 0xffff, 0x7fffffff,
+		0x80000000, 0xffffffff,
+	};
+	const int nmutations = 1 + (int)(_test_rand(rng) % 4);
+	for (int m = 0; m < nmutations; m++) {
+		const uint64_t r = _test_rand(rng);
+		const size_t pos = size ? (size_t)(r >> 8) % size : 0;
+		const uint8_t byte = (uint8_t)(r >> 40);
+		switch (r % 8) {
+		case 0: if (size) buf[pos] ^= (uint8_t)(1 << byte % 8); break;
+		case 1: if (size) buf[pos] = byte; break;
+		case 2: if (size) buf[pos] += (uint8_t)(byte % 33 - 16); break;
+		case 3: {
+			// Insert a few random bytes
+			size_t len = 1 + (r >> 40) % 8;
+			if (len > max - size) len = max - size;
+			memmove(buf + pos + len, buf + pos, size - pos);
+			for (size_t i = 0; i < len; i++) {
+				buf[pos + i] = (uint8_t)_test_rand(rng);
+			}
+			size += len;
+			break;
+		}
+		case 4: {
+			if (!size) break;
+			size_t len = 1 + (r >> 40) % 16;
+			if (len > size - pos) len = size - pos;
+			memmove(buf + pos, buf + pos + len, size - pos - len);
+			size -= len;
+			break;
+		}
+		case 5: {
+			// Little endian 1, 2 or 4 byte interesting value
+			const uint32_t val = interesting
+				[(r >> 40) % (sizeof(interesting) / 4)];
+			const size_t width = (size_t)1 << (r >> 50) % 3;
+			if (size < width) break;
+			const size_t at =
+				pos > size - width ? size - width : pos;
+			for (size_t i = 0; i < width; i++) {
+				buf[at + i] = (uint8_t)(val >> i * 8);
+			}
+			break;
+		}
+		case 6: {
+			// Copy a chunk of the input over another part of it
+			if (!size) break;
+			const size_t from = (size_t)(r >> 40) % size;
+			size_t len = 1 + (size_t)_test_rand(rng) % size;
+			if (len > size - from) len = size - from;
+			if (len > size - pos) len = size - pos;
+			memmove(buf + pos, buf + from, len);
+			break;
+		}
+		default: {
+			// Splice in part of another corpus input
+			const _test_input_t *other =
+				&inputs[(r >> 40) % ninputs];
+			if (!other->size) break;
+			const size_t from =
+				(size_t)_test_rand(rng) % other->size;
+			size_t len = other->size - from;
+			if (len > max - pos) len = max - pos;
+			memcpy(buf + pos, other->data + from, len);
+			if (pos + len > size) size = pos + len;
+			break;
+		}
+		}
+	}
+	return size;
+}
+
+static void _test_fuzz_crash(int sig) {
+	_test_fuzz_shared_t *shared = _test_fuzz_cur.shared;
+	if (!__atomic_exchange_n(&shared->crashed, 1, __ATOMIC_SEQ_CST)) {
+		_test_write_input(shared->crash,
+				  sizeof(shared->crash),
+				  "crash-",
+				  _test_fuzz_cur.data,
+				  _test_fuzz_cur.size);
+		snprintf(shared->msg,
+			 sizeof(shared->msg),
+			 "crashed with signal %d",
+			 sig);
+	}
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static void _test_fuzz_worker(
+	const _test_state_t *state, _test_t *test, int worker) {
+	_test_fuzz_shared_t *shared = _test_fuzz_cur.shared;
+	const int sigs[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+	for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+		signal(sigs[i], _test_fuzz_crash);
+	}
+
+	_test_input_t *inputs;
+	size_t ninputs = _test_fuzz_load(&inputs), cap = ninputs;
+	uint8_t *buf = (uint8_t *)malloc(state->max_len + 1);
+	uint64_t rng = state->seed * 0x9E3779B97F4A7C15ULL + (uint64_t)worker;
+	if (!rng) rng = 1;
+
+	for (uint64_t execs = 1;; execs++) {
+		const _test_input_t *parent =
+			&inputs[_test_rand(&rng) % ninputs];
+		size_t size = parent->size < state->max_len ? parent->size
+							    : state->max_len;
+		memcpy(buf, parent->data, size);
+		size = _test_mutate(
+			buf, size, state->max_len, inputs, ninputs, &rng);
+
+		_test_fuzz_cur.data = buf, _test_fuzz_cur.size = size;
+		_test_msglen = 0, _test_msg[0] = '\0';
+		const uint32_t edges = _test_cov_new;
+		const int fail_line = test->fuzzfn(buf, size);
+		_test_arena_rewind(0);
+		if (!(execs % 256)) {
+			__atomic_fetch_add(
+				&shared->execs[worker], 256, __ATOMIC_RELAXED);
+		}
+
+		if (fail_line) {
+			if (!__atomic_exchange_n(
+				    &shared->crashed, 1, __ATOMIC_SEQ_CST)) {
+				_test_write_input(shared->crash,
+						  sizeof(shared->crash),
+						  "crash-",
+						  buf,
+						  size);
+				snprintf(shared->msg,
+					 sizeof(shared->msg),
+					 "on line %d: %s",
+					 fail_line,
+					 _test_msg);
+			}
+			_exit(1);
+		}
+		if (_test_cov_new == edges) continue;
+
+		// New coverage, keep the input around
+		if (ninputs == cap) {
+			cap *= 2;
+			inputs = (_test_input_t *)realloc(
+				inputs, cap * sizeof(_test_input_t));
+		}
+		inputs[ninputs].data = (uint8_t *)malloc(size ? size : 1);
+		memcpy(inputs[ninputs].data, buf, size);
+		inputs[ninputs++].size = size;
+		char path[1024];
+		_test_write_input(path, sizeof(path), "", buf, size);
+		__atomic_fetch_add(&shared->corpus, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&shared->edges,
+				   _test_cov_new - edges,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+// Whether the input fails, run in a child so crashes count as failing too
+static bool _test_fuzz_fails(_test_t *test, const uint8_t *data, size_t size) {
+	fflush(NULL);
+	const pid_t pid = fork();
+	if (!pid) {
+		const int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO), dup2(null, STDERR_FILENO);
+		const int sigs[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+		for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+			signal(sigs[i], SIG_DFL);
+		}
+		_exit(test->fuzzfn(data, size) ? 1 : 0);
+	}
+	int status;
+	if (pid < 0 || waitpid(pid, &status, 0) < 0) return false;
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+// Cuts out smaller and smaller chunks of the input while it keeps failing
+static size_t _test_fuzz_minimize(_test_t *test, uint8_t *data, size_t size) {
+	uint8_t *buf = (uint8_t *)malloc(size ? size : 1);
+	for (size_t chunk = size / 2 ? size / 2 : 1; chunk && size;) {
+		bool cut = false;
+		for (size_t off = 0; off + chunk <= size;) {
+			memcpy(buf, data, off);
+			memcpy(buf + off,
+			       data + off + chunk,
+			       size - off - chunk);
+			if (_test_fuzz_fails(test, buf, size - chunk)) {
+				memcpy(data, buf, size - chunk);
+				size -= chunk, cut = true;
+			} else {
+				off += chunk;
+			}
+		}
+		if (!cut) chunk /= 2;
+	}
+	free(buf);
+	return size;
+}
+
+static inline int _test_fuzz(_test_state_t *state, _test_t *test) {
+	const char *root = state->corpus ? state->corpus : "corpus";
+	mkdir(root, 0755);
+	_test_fuzz_dir(state, test);
+	mkdir(_test_fuzz_cur.dir, 0755);
+	_test_fuzz_shared_t *shared = (_test_fuzz_shared_t *)mmap(
+		NULL,
+		sizeof(_test_fuzz_shared_t),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS,
+		-1,
+		0);
+	if (shared == MAP_FAILED) return 1;
+	_test_fuzz_cur.shared = shared;
+	if (!state->jobs) state->jobs = 1;
+
+	printf("Fuzzing %s with %d worker%s (seed %llu), corpus in %s\n",
+	       test->name,
+	       state->jobs,
+	       state->jobs == 1 ? "" : "s",
+	       (unsigned long long)state->seed,
+	       _test_fuzz_cur.dir);
+	if (!_test_cov_edges && !_test_cov_new) {
+		printf("No coverage instrumentation, build with "
+		       "-fsanitize-coverage=trace-pc-guard (or trace-pc) to "
+		       "keep new inputs\n");
+	}
+	fflush(NULL);
+
+	pid_t workers[64];
+	for (int i = 0; i < state->jobs; i++) {
+		if (!(workers[i] = fork())) _test_fuzz_worker(state, test, i);
+	}
+
+	const uint64_t start = _test_now();
+	uint64_t execs = 0, shown = 0;
+	for (int alive = state->jobs; alive && !shared->crashed;) {
+		usleep(100000);
+		for (int i = 0; i < state->jobs; i++) {
+			if (workers[i] > 0
+			    && waitpid(workers[i], NULL, WNOHANG) > 0) {
+				workers[i] = 0, alive--;
+			}
+		}
+
+		const double secs = (double)(_test_now() - start) / 1e9;
+		execs = 0;
+		for (int i = 0; i < state->jobs; i++) {
+			execs += __atomic_load_n(
+				&shared->execs[i], __ATOMIC_RELAXED);
+		}
+		const bool done = secs >= state->fuzz_time;
+		// Status line once a second
+		if ((uint64_t)secs != shown || done) {
+			shown = (uint64_t)secs;
+			printf("#%-12llu %8.0f exec/s, %u corpus, %u edges\n",
+			       (unsigned long long)execs,
+			       (double)execs / secs,
+			       shared->corpus,
+			       shared->edges);
+			fflush(stdout);
+		}
+		if (done) break;
+	}
+	for (int i = 0; i < state->jobs; i++) {
+		if (workers[i] <= 0) continue;
+		kill(workers[i], SIGKILL);
+		waitpid(workers[i], NULL, 0);
+	}
+
+	const double secs = (double)(_test_now() - start) / 1e9;
+	printf("Done after %llu execs in %.1fs (%.0f exec/s)\n",
+	       (unsigned long long)execs,
+	       secs,
+	       (double)execs / secs);
+	if (!shared->crashed) return 0;
+
+	printf("\x1B[31m[FAIL]\x1B[0m %s %s\n", test->name, shared->msg);
+	size_t size;
+	uint8_t *data = _test_read_file(shared->crash, &size);
+	if (data) {
+		const size_t orig = size;
+		size = _test_fuzz_minimize(test, data, size);
+		char path[1024];
+		_test_write_input(path, sizeof(path), "crash-", data, size);
+		printf("Crashing input minimized from %zu to %zu bytes: %s\n",
+		       orig,
+		       size,
+		       path);
+		if (strcmp(path, shared->crash)) unlink(shared->crash);
+		free(data);
+	}
+	return 1;
+}
+
+// Stress mode, --stress=name[,name...]. Each test named runs over and over on
+// --jobs threads (one per cpu by default) released together at a barrier,
+// for --stress-time seconds or --stress-count runs per thread, until the
+// first failure. Throughput is tracked per sixteenth of the run so slowdowns
+// from contention or leaks show, along with allocations and resident memory.
+typedef struct _test_stress {
+	_test_t *test;
+	uint64_t ns;
+	size_t count;
+	int ready;
+	bool go, stop;
+
+	// The first failure
+	int line, thread;
+	size_t iter;
+	char msg[1024];
+} _test_stress_t;
+
+typedef struct _test_stress_thread {
+	_test_stress_t *run;
+	pthread_t id;
+	int thread;
+	size_t execs, arena_peak;
+	// Runs done at the end of each sixteenth of the time, or when each
+	// sixteenth of the count was done
+	uint64_t marks[16];
+} _test_stress_thread_t;
+
+static void *_test_stress_thread(void *arg) {
+	_test_stress_thread_t *self = (_test_stress_thread_t *)arg;
+	_test_stress_t *run = self->run;
+	_test_t *test = run->test;
+	size_t spins = 0;
+	__atomic_fetch_add(&run->ready, 1, __ATOMIC_ACQ_REL);
+	while (!__atomic_load_n(&run->go, __ATOMIC_ACQUIRE)) _test_spin(&spins);
+	const uint64_t start = _test_now();
+	int mark = 0;
+	while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED)) {
+		_test_msglen = 0, _test_msg[0] = '\0';
+		const int line = test->call ? test->call(test) : test->testfn();
+		const size_t used = _test_arena_rewind(0);
+		if (used > self->arena_peak) self->arena_peak = used;
+		if (line) {
+			if (!__atomic_exchange_n(
+				    &run->stop, true, __ATOMIC_ACQ_REL)) {
+				run->line = line, run->thread = self->thread;
+				run->iter = self->execs;
+				memcpy(run->msg, _test_msg, sizeof(run->msg));
+			}
+			break;
+		}
+		self->execs++;
+		if (run->count) {
+			while (mark < 16
+			       && self->execs >= run->count * (mark + 1) / 16) {
+				self->marks[mark++] = _test_now() - start;
+			}
+			if (self->execs >= run->count) break;
+			continue;
+		}
+		const uint64_t now = _test_now() - start;
+		while (mark < 16 && now >= run->ns * (mark + 1) / 16) {
+			self->marks[mark++] = self->execs;
+		}
+		if (mark == 16) break;
+	}
+	return NULL;
+}
+
+static size_t _test_rss(void) {
+	FILE *statm = fopen("/proc/self/statm", "r");
+	unsigned long pages = 0;
+	if (statm) {
+		if (fscanf(statm, "%*s %lu", &pages) != 1) pages = 0;
+		fclose(statm);
+	}
+	return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static bool _test_stress_one(_test_state_t *state, _test_t *test) {
+	int nthreads = state->jobs;
+	if (!nthreads) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > 64) nthreads = 64;
+	_test_stress_t *run = (_test_stress_t *)calloc(1, sizeof(*run));
+	_test_stress_thread_t *threads = (_test_stress_thread_t *)calloc(
+		(size_t)nthreads, sizeof(*threads));
+	if (!run || !threads) {
+		free(run);
+		free(threads);
+		return false;
+	}
+	run->test = test;
+	run->count = state->stress_count;
+	run->ns = (uint64_t)(state->stress_time * 1e9);
+	if (run->count) {
+		printf("Stressing %s on %d thread%s, %zu runs each\n",
+		       test->name,
+		       nthreads,
+		       nthreads == 1 ? "" : "s",
+		       run->count);
+	} else {
+		printf("Stressing %s on %d thread%s for %.1fs\n",
+		       test->name,
+		       nthreads,
+		       nthreads == 1 ? "" : "s",
+		       state->stress_time);
+	}
+	fflush(stdout);
+
+	state->current = test;
+	const size_t rss = _test_rss();
+	const size_t allocs = __atomic_load_n(&_test_nallocs, __ATOMIC_RELAXED);
+	int started = 0;
+	for (; started < nthreads; started++) {
+		_test_stress_thread_t *thread = &threads[started];
+		thread->run = run, thread->thread = started;
+		if (pthread_create(&thread->id,
+				   NULL,
+				   _test_stress_thread,
+				   thread)) {
+			break;
+		}
+	}
+	if (started < nthreads) run->stop = true;
+	size_t spins = 0;
+	while (__atomic_load_n(&run->ready, __ATOMIC_ACQUIRE) < started) {
+		_test_spin(&spins);
+	}
+	const uint64_t start = _test_now();
+	__atomic_store_n(&run->go, true, __ATOMIC_RELEASE);
+	size_t execs = 0;
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i].id, NULL);
+		execs += threads[i].execs;
+		if (threads[i].arena_peak > test->arena_peak) {
+			test->arena_peak = threads[i].arena_peak;
+		}
+	}
+	const double secs = (double)(_test_now() - start) / 1e9;
+	state->current = NULL;
+
+	printf("Done after %zu runs in %.1fs (%.0f runs/s), ",
+	       execs,
+	       secs,
+	       (double)execs / secs);
+#ifdef _TEST_ALLOC_COUNT
+	printf("%.2f allocs/run, ",
+	       execs ? (double)(__atomic_load_n(
+				       &_test_nallocs, __ATOMIC_RELAXED)
+				- allocs)
+			       / (double)execs
+		     : 0.0);
+#else
+	(void)allocs;
+#endif
+	printf("resident memory %.1fM -> %.1fM\n",
+	       (double)rss / (1 << 20),
+	       (double)_test_rss() / (1 << 20));
+	if (test->arena_peak) {
+		printf("  arena peak ");
+		_test_print_bytes(stdout, test->arena_peak);
+		printf(" in a run\n");
+	}
+
+	// Throughput of each sixteenth relative to the first, summed over the
+	// threads. Runs of fewer than 16 can't be split like that.
+	if (!run->line && started == nthreads
+	    && (!run->count || run->count >= 16)) {
+		double rates[16];
+		for (int k = 0; k < 16; k++) {
+			// Runs in this sixteenth of the count
+			const size_t runs = run->count * (size_t)(k + 1) / 16
+				- run->count * (size_t)k / 16;
+			rates[k] = 0.0;
+			for (int i = 0; i < nthreads; i++) {
+				const uint64_t *marks = threads[i].marks;
+				const uint64_t prev = k ? marks[k - 1] : 0;
+				rates[k] += run->count
+					? (double)runs
+						/ (double)(marks[k] - prev + 1)
+					: (double)(marks[k] - prev);
+			}
+		}
+		printf("  throughput over the run:");
+		for (int k = 0; k < 16; k++) {
+			printf(" %.2f",
+			       rates[0] > 0.0 ? rates[k] / rates[0] : 0.0);
+		}
+		printf("\n");
+	}
+
+	if (run->line) {
+		printf("\x1B[31m[FAIL]\x1B[0m %s on run %zu of thread %d "
+		       "(on line %d)\n",
+		       test->name,
+		       run->iter,
+		       run->thread,
+		       run->line);
+		if (*run->msg) printf(" %s\n", run->msg);
+	} else if (started < nthreads) {
+		printf("\x1B[31m[FAIL]\x1B[0m %s: only %d threads started\n",
+		       test->name,
+		       started);
+	} else {
+		printf("\x1B[32m[PASS]\x1B[0m %s\n", test->name);
+	}
+	fflush(stdout);
+	const bool passed = !run->line && started == nthreads;
+	free(run);
+	free(threads);
+	return passed;
+}
+
+// Whether name is one of the comma separated names in list
+static bool _test_listed(const char *list, const char *name) {
+	const size_t len = strlen(name);
+	for (const char *at = list; at; at = strchr(at, ',')) {
+		if (*at == ',') at++;
+		if (!strncmp(at, name, len) && (!at[len] || at[len] == ',')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static inline int _test_stress(_test_state_t *state) {
+	int found = 0, failed = 0;
+	for (int i = 0; i < state->ntests; i++) {
+		_test_t *test = state->tests[i];
+		if (test->kind != _TEST_TEST || test->fixture
+		    || !_test_listed(state->stress, test->name)) {
+			continue;
+		}
+		if (found++) printf("\n");
+		failed += !_test_stress_one(state, test);
+	}
+	if (!found) fprintf(stderr, "no tests named %s\n", state->stress);
+	return !found ? 2 : failed ? 1 : 0;
+}
+
+// A/B comparison, --compare=b (this binary against b) or --compare=a,b. Both
+// binaries are started as --worker children pinned to the same core, and
+// take turns running one sample of each benchmark they have in common in
+// ABBA order, so drift over the run hits both equally. The speedup is the
+// median of the per round ratios, with a Wilcoxon signed-rank test on the
+// rounds for whether it is real.
+typedef struct _test_worker {
+	const char *path;
+	pid_t pid;
+	FILE *in, *out;
+
+	// For --layouts, "stack,heap" offsets and padding for the environment
+	const char *layout, *pad;
+} _test_worker_t;
+
+// Serves the runner over the socket from --worker=fd, leaving stdout to the
+// benchmarks: "list" answers with "nsamples name" lines and "end", "sample
+// name" runs one sample and answers "ns ops" (or "skip").
+static inline int _test_work(_test_state_t *state) {
+	FILE *in = fdopen(state->worker, "r");
+	FILE *out = fdopen(dup(state->worker), "w");
+	if (!in || !out) {
+		fprintf(stderr, "bad --worker socket %d\n", state->worker);
+		return 2;
+	}
+
+	// Offsets from --layouts, the stack one covers every sample below
+	const char *layout = getenv("TEST_LAYOUT");
+	unsigned long long stack = 0, heap = 0;
+	if (layout) sscanf(layout, "%llu,%llu", &stack, &heap);
+	volatile char *pad = (volatile char *)__builtin_alloca(stack + 1);
+	pad[0] = 0;
+	void *shift = heap ? malloc(heap) : NULL;
+	char line[512];
+	while (fgets(line, sizeof(line), in)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!strcmp(line, "list")) {
+			for (int i = 0; i < state->nbenches; i++) {
+				const _test_t *test = state->benches[i];
+				if (test->kind != _TEST_BENCH) continue;
+				fprintf(out,
+					"%zu %s\n",
+					_test_bench_nsamples(&test->bench),
+					test->name);
+			}
+			fprintf(out, "end\n");
+		} else if (!strncmp(line, "sample ", 7)) {
+			_test_t *test = _test_bench_lookup(line + 7);
+			if (!test || test->kind != _TEST_BENCH || test->skip
+			    || (!test->measured && test->bench.prepare
+				&& !test->bench.prepare(test))) {
+				if (test) test->skip = "can't prepare";
+				fprintf(out, "skip\n");
+				fflush(out);
+				continue;
+			}
+			// Prepared once, measured stays set until release
+			test->measured = true;
+			// Samples are compared per op, so they can all be the
+			// biggest
+			const size_t iters = _test_bench_iters(&test->bench, 0);
+			_test_bench_order(&test->bench, iters);
+			_test_file_begin(test);
+			const uint64_t ns =
+				_test_bench_sample(&test->bench, iters);
+			_test_arena_rewind(0);
+			fprintf(out,
+				"%llu %zu\n",
+				(unsigned long long)ns,
+				iters * test->bench.nitems);
+		} else if (!strcmp(line, "quit")) {
+			break;
+		}
+		fflush(out);
+	}
+	fclose(in);
+	fclose(out);
+	for (int i = 0; i < state->nbenches; i++) {
+		_test_t *test = state->benches[i];
+		if (test->kind != _TEST_BENCH) continue;
+		free(test->bench.indices);
+		test->bench.indices = NULL;
+		if (test->measured && !test->skip && test->bench.release) {
+			test->bench.release(test);
+		}
+	}
+	free(shift);
+	return 0;
+}
+
+// The worker talks over its end of a socket pair, the only one it inherits
+static bool _test_worker_start(_test_worker_t *worker, int cpu) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+		return false;
+	}
+	char arg[32];
+	snprintf(arg, sizeof(arg), "--worker=%d", fds[1]);
+	fflush(NULL);
+	worker->pid = fork();
+	if (!worker->pid) {
+		fcntl(fds[1], F_SETFD, 0);
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (cpu >= 0 && cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &set);
+			sched_setaffinity(0, sizeof(set), &set);
+		}
+		if (worker->layout) setenv("TEST_LAYOUT", worker->layout, 1);
+		if (worker->pad) setenv("TEST_LAYOUT_PAD", worker->pad, 1);
+		execl(worker->path, worker->path, arg, (char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+	if (worker->pid < 0) {
+		close(fds[0]);
+		return false;
+	}
+	worker->in = fdopen(fds[0], "w");
+	worker->out = fdopen(fcntl(fds[0], F_DUPFD_CLOEXEC, 0), "r");
+	return worker->in && worker->out;
+}
+
+static void _test_worker_stop(_test_worker_t *worker) {
+	if (worker->in) fclose(worker->in);
+	if (worker->out) fclose(worker->out);
+	if (worker->pid > 0) waitpid(worker->pid, NULL, 0);
+}
+
+static bool _test_worker_read(_test_worker_t *worker, char *line, size_t size) {
+	if (!fgets(line, (int)size, worker->out)) return false;
+	line[strcspn(line, "\n")] = '\0';
+	return true;
+}
+
+// Sends a command and reads the first line of the answer
+static bool _test_worker_ask(
+	_test_worker_t *worker, const char *cmd, char *line, size_t size) {
+	fprintf(worker->in, "%s\n", cmd);
+	fflush(worker->in);
+	return _test_worker_read(worker, line, size);
+}
+
+// Time per op of one sample, or a negative number if there isn't one
+static double _test_worker_sample(_test_worker_t *worker, const char *name) {
+	char cmd[512], line[128];
+	unsigned long long ns;
+	size_t ops;
+	snprintf(cmd, sizeof(cmd), "sample %s", name);
+	if (!_test_worker_ask(worker, cmd, line, sizeof(line))
+	    || sscanf(line, "%llu %zu", &ns, &ops) != 2 || !ops) {
+		return -1.0;
+	}
+	return (double)ns / (double)ops;
+}
+
+typedef struct _test_rank {
+	double abs;
+	bool positive;
+} _test_rank_t;
+
+static int _test_cmp_rank(const void *a, const void *b) {
+	return _test_cmp_double(&((const _test_rank_t *)a)->abs,
+				&((const _test_rank_t *)b)->abs);
+}
+
+// Wilcoxon signed-rank statistic of the paired differences a - b, as a
+// z score (normal approximation, ties get their average rank)
+static double _test_signed_rank(const double *a, const double *b, size_t n) {
+	_test_rank_t *diffs = (_test_rank_t *)malloc(n * sizeof(*diffs));
+	if (!diffs) return 0.0;
+	size_t m = 0;
+	for (size_t i = 0; i < n; i++) {
+		const double d = a[i] - b[i];
+		if (d == 0.0) continue;
+		diffs[m].abs = d < 0.0 ? -d : d, diffs[m++].positive = d > 0.0;
+	}
+	qsort(diffs, m, sizeof(*diffs), _test_cmp_rank);
+	double positive = 0.0;
+	for (size_t i = 0, j; i < m; i = j) {
+		for (j = i + 1; j < m && diffs[j].abs == diffs[i].abs; j++) {}
+		const double rank = (double)(i + j + 1) / 2.0;
+		for (size_t k = i; k < j; k++) {
+			if (diffs[k].positive) positive += rank;
+		}
+	}
+	free(diffs);
+	const double mean = (double)m * (double)(m + 1) / 4.0;
+	const double var =
+		(double)m * (double)(m + 1) * (double)(2 * m + 1) / 24.0;
+	return var > 0.0 ? (positive - mean) / _test_sqrt(var) : 0.0;
+}
+
+static inline int _test_compare(_test_state_t *state) {
+	_test_worker_t workers[2];
+	memset(workers, 0, sizeof(workers));
+	static char paths[2][1024];
+	const char *comma = strchr(state->compare, ',');
+	if (comma) {
+		snprintf(paths[0],
+			 sizeof(paths[0]),
+			 "%.*s",
+			 (int)(comma - state->compare),
+			 state->compare);
+		snprintf(paths[1], sizeof(paths[1]), "%s", comma + 1);
+	} else {
+		snprintf(paths[0], sizeof(paths[0]), "/proc/self/exe");
+		snprintf(paths[1], sizeof(paths[1]), "%s", state->compare);
+	}
+	const int cpu = sched_getcpu();
+	signal(SIGPIPE, SIG_IGN);
+	for (int i = 0; i < 2; i++) {
+		workers[i].path = paths[i];
+		if (!_test_worker_start(&workers[i], cpu)) {
+			fprintf(stderr, "can't start %s\n", paths[i]);
+			_test_worker_stop(&workers[0]);
+			return 2;
+		}
+	}
+
+	// The benchmarks of A that B has too
+	char names[1024][128];
+	size_t nsamples[1024];
+	int n = 0;
+	char line[512];
+	bool common[1024] = {false};
+	bool ok = _test_worker_ask(&workers[0], "list", line, sizeof(line));
+	bool started = ok;
+	for (; ok && strcmp(line, "end");
+	     ok = _test_worker_read(&workers[0], line, sizeof(line))) {
+		int len = 0;
+		if (n == 1024 || sscanf(line, "%zu %n", &nsamples[n], &len) != 1
+		    || !len) {
+			continue;
+		}
+		snprintf(names[n++], sizeof(names[0]), "%s", line + len);
+	}
+	ok = _test_worker_ask(&workers[1], "list", line, sizeof(line));
+	started = started && ok;
+	for (; ok && strcmp(line, "end");
+	     ok = _test_worker_read(&workers[1], line, sizeof(line))) {
+		const char *name = strchr(line, ' ');
+		for (int i = 0; name && i < n; i++) {
+			if (!strcmp(names[i], name + 1)) common[i] = true;
+		}
+	}
+	if (!started) {
+		fprintf(stderr, "can't run %s and %s\n", paths[0], paths[1]);
+		for (int i = 0; i < 2; i++) _test_worker_stop(&workers[i]);
+		return 2;
+	}
+
+	printf("Comparing %s (A) with %s (B) in ABBA order on cpu %d\n",
+	       comma ? paths[0] : state->progname,
+	       paths[1],
+	       cpu);
+	printf("  %-24s %8s   %8s   B vs A\n", "", "A median", "B median");
+	for (int i = 0; i < n; i++) {
+		if (!common[i]) {
+			printf("  %-24s only in A\n", names[i]);
+			continue;
+		}
+		const size_t rounds = nsamples[i] < 4 ? 4 : nsamples[i];
+		double *samples = (double *)malloc(3 * rounds * sizeof(double));
+		if (!samples) break;
+		double *a = samples, *b = samples + rounds;
+		size_t done = 0;
+		for (; done < rounds; done++) {
+			// A B, then B A
+			const int first = (int)(done % 2);
+			double *out[2] = {a, b};
+			out[first][done] =
+				_test_worker_sample(&workers[first], names[i]);
+			out[!first][done] =
+				_test_worker_sample(&workers[!first], names[i]);
+			if (a[done] < 0.0 || b[done] < 0.0) break;
+		}
+		if (done < rounds) {
+			printf("  %-24s skipped\n", names[i]);
+			free(samples);
+			continue;
+		}
+
+		double *ratios = samples + 2 * rounds;
+		for (size_t r = 0; r < rounds; r++) {
+			ratios[r] = b[r] > 0.0 ? a[r] / b[r] : 1.0;
+		}
+		const double z = _test_signed_rank(a, b, rounds);
+		_test_stats_t sa, sb, speedup;
+		_test_summarize(&sa, a, rounds);
+		_test_summarize(&sb, b, rounds);
+		_test_summarize(&speedup, ratios, rounds);
+		const double absz = z < 0.0 ? -z : z;
+		printf("  %-24s ", names[i]);
+		_test_print_time(stdout, sa.median);
+		printf("   ");
+		_test_print_time(stdout, sb.median);
+		// Only when the speedup's confidence interval agrees
+		if (absz < 1.96 || (speedup.lo <= 1.0 && speedup.hi >= 1.0)) {
+			printf("   no significant difference (p > 0.05)\n");
+		} else {
+			const bool faster = speedup.median >= 1.0;
+			printf("   %.2fx %s [%.2fx - %.2fx], p < %s\n",
+			       faster ? speedup.median : 1.0 / speedup.median,
+			       faster ? "faster" : "slower",
+			       faster ? speedup.lo : 1.0 / speedup.hi,
+			       faster ? speedup.hi : 1.0 / speedup.lo,
+			       absz >= 3.29	? "0.001"
+			       : absz >= 2.576 ? "0.01"
+					       : "0.05");
+		}
+		fflush(stdout);
+		free(samples);
+	}
+	for (int i = 0; i < 2; i++) {
+		fprintf(workers[i].in, "quit\n");
+		_test_worker_stop(&workers[i]);
+	}
+	return 0;
+}
+
+// Layout randomization, --layouts=n. Where code and data happen to land can
+// move timings by more than a real optimization does, so every benchmark is
+// run in n --worker children whose stacks (alloca padding), heaps (a leading
+// allocation) and environments (which move the initial stack) are offset by
+// random amounts. The first layout is left as is. Samples are taken round
+// robin over the layouts, and how far their medians spread tells alignment
+// luck from real changes.
+static inline int _test_layouts(_test_state_t *state) {
+	const int n = state->layouts;
+	_test_worker_t workers[64];
+	memset(workers, 0, sizeof(workers));
+	static char layouts[64][64];
+	uint64_t rng = state->seed;
+	const int cpu = sched_getcpu();
+	signal(SIGPIPE, SIG_IGN);
+	int started = 0;
+	for (; started < n; started++) {
+		_test_worker_t *worker = &workers[started];
+		worker->path = "/proc/self/exe";
+		if (started) {
+			const size_t env = (size_t)(_test_rand(&rng) % 4096);
+			const unsigned long long stack =
+				_test_rand(&rng) % 256 * 16;
+			const unsigned long long heap =
+				_test_rand(&rng) % 256 * 16;
+			snprintf(layouts[started],
+				 sizeof(layouts[0]),
+				 "%llu,%llu",
+				 stack,
+				 heap);
+			char *pad = (char *)malloc(env + 1);
+			if (!pad) break;
+			memset(pad, 'x', env), pad[env] = '\0';
+			worker->layout = layouts[started], worker->pad = pad;
+		}
+		if (!_test_worker_start(worker, cpu)) break;
+	}
+	char names[1024][128];
+	size_t nsamples[1024];
+	int nbenches = 0;
+	char line[512];
+	bool ok = started == n
+		&& _test_worker_ask(&workers[0], "list", line, sizeof(line));
+	if (!ok) fprintf(stderr, "can't start %d workers\n", n);
+	for (; ok && strcmp(line, "end");
+	     ok = _test_worker_read(&workers[0], line, sizeof(line))) {
+		int len = 0;
+		if (nbenches == 1024
+		    || sscanf(line, "%zu %n", &nsamples[nbenches], &len) != 1
+		    || !len) {
+			continue;
+		}
+		snprintf(names[nbenches++], sizeof(names[0]), "%s", line + len);
+	}
+
+	if (started == n) {
+		printf("Running %d layouts round robin on cpu %d (seed %llu)\n",
+		       n,
+		       cpu,
+		       (unsigned long long)state->seed);
+		printf("  %-24s %8s   %8s   %8s   spread\n",
+		       "",
+		       "as is",
+		       "fastest",
+		       "slowest");
+	}
+	for (int i = 0; started == n && i < nbenches; i++) {
+		const size_t rounds = nsamples[i] < 4 ? 4 : nsamples[i];
+		double *samples =
+			(double *)malloc((size_t)n * rounds * sizeof(double));
+		if (!samples) break;
+		bool skipped = false;
+		for (size_t r = 0; !skipped && r < rounds; r++) {
+			// Rotated every round so no layout always goes first
+			for (size_t k = 0; !skipped && k < (size_t)n; k++) {
+				const size_t j = (r + k) % (size_t)n;
+				double *at = &samples[j * rounds + r];
+				*at = _test_worker_sample(
+					&workers[j], names[i]);
+				skipped = *at < 0.0;
+			}
+		}
+		if (skipped) {
+			printf("  %-24s skipped\n", names[i]);
+			free(samples);
+			continue;
+		}
+
+		_test_stats_t stats[64];
+		int fastest = 0, slowest = 0;
+		for (int j = 0; j < n; j++) {
+			_test_stats_t *layout = &stats[j];
+			_test_summarize(
+				layout, &samples[(size_t)j * rounds], rounds);
+			if (layout->median < stats[fastest].median) {
+				fastest = j;
+			}
+			if (layout->median > stats[slowest].median) {
+				slowest = j;
+			}
+		}
+		printf("  %-24s ", names[i]);
+		_test_print_time(stdout, stats[0].median);
+		printf("   ");
+		_test_print_time(stdout, stats[fastest].median);
+		printf("   ");
+		_test_print_time(stdout, stats[slowest].median);
+		printf("   %5.1f%%",
+		       stats[fastest].median > 0.0
+			       ? 100.0
+				       * (stats[slowest].median
+					  - stats[fastest].median)
+				       / stats[fastest].median
+			       : 0.0);
+		// Only when the extremes' confidence intervals don't overlap
+		printf("%s\n",
+		       stats[slowest].lo > stats[fastest].hi
+			       ? ", layout sensitive"
+			       : "");
+		fflush(stdout);
+		free(samples);
+	}
+	for (int i = 0; i < n; i++) {
+		if (workers[i].in) fprintf(workers[i].in, "quit\n");
+		_test_worker_stop(&workers[i]);
+		free((char *)workers[i].pad);
+	}
+	return started == n && ok ? 0 : 2;
+}
+
+// Machine characterization for --machine: load latency at each cache level by
+// chasing pointers through a random cycle of cache lines, read bandwidth on one
+// and on all cores, and what reading the clock costs.
+static size_t _test_cache_size(int name, size_t fallback) {
+	const long size = sysconf(name);
+	return size > 0 ? (size_t)size : fallback;
+}
+
+// Nanoseconds per load chasing through bytes worth of cache lines
+static double _test_chase(size_t bytes, uint64_t *rng) {
+	const size_t n = bytes / 64, stride = 64 / sizeof(void *);
+	void **buf = (void **)aligned_alloc(64, n * 64);
+	size_t *order = (size_t *)malloc(n * sizeof(size_t));
+	if (!buf || !order || n < 2) {
+		free(buf);
+		free(order);
+		return 0.0;
+	}
+	for (size_t i = 0; i < n; i++) order[i] = i;
+	for (size_t i = n - 1; i > 0; i--) {
+		const size_t j = (size_t)_test_rand(rng) % (i + 1);
+		const size_t tmp = order[i];
+		order[i] = order[j], order[j] = tmp;
+	}
+	for (size_t i = 0; i < n; i++) {
+		buf[order[i] * stride] = &buf[order[(i + 1) % n] * stride];
+	}
+
+	// Warms the caches up first, for the sizes that fit in them
+	const size_t steps = 1 << 21;
+	void **p = &buf[order[0] * stride];
+	for (size_t i = 0; i < n && i < steps; i++) p = (void **)*p;
+	const uint64_t start = _test_now();
+	for (size_t i = 0; i < steps; i++) p = (void **)*p;
+	const double ns = (double)(_test_now() - start) / (double)steps;
+	__asm__ volatile("" : : "r"(p));
+	free(order);
+	free(buf);
+	return ns;
+}
+
+typedef struct _test_sweep {
+	const uint64_t *data;
+	size_t len, rounds;
+	int *ready, nthreads;
+} _test_sweep_t;
+
+static void *_test_sweep(void *arg) {
+	const _test_sweep_t *sweep = (const _test_sweep_t *)arg;
+	__atomic_fetch_add(sweep->ready, 1, __ATOMIC_ACQ_REL);
+	for (size_t spins = 0; __atomic_load_n(sweep->ready, __ATOMIC_ACQUIRE)
+	     < sweep->nthreads;) {
+		_test_spin(&spins);
+	}
+	const uint64_t *data = sweep->data;
+	uint64_t sum[4] = {0, 0, 0, 0};
+	for (size_t r = 0; r < sweep->rounds; r++) {
+		for (size_t i = 0; i + 4 <= sweep->len; i += 4) {
+			sum[0] += data[i], sum[1] += data[i + 1];
+			sum[2] += data[i + 2], sum[3] += data[i + 3];
+		}
+	}
+	__asm__ volatile("" : : "r"(sum[0] + sum[1] + sum[2] + sum[3]));
+	return NULL;
+}
+
+// GB/s reading the buffer split between nthreads threads
+static double _test_bandwidth(const uint64_t *data, size_t len, int nthreads) {
+	_test_sweep_t sweeps[256];
+	pthread_t threads[256];
+	int ready = 0, started = 0;
+	const size_t rounds = 4;
+	if (nthreads > 256) nthreads = 256;
+	for (int i = 0; i < nthreads; i++) {
+		sweeps[i].data = data + len / (size_t)nthreads * (size_t)i;
+		sweeps[i].len = len / (size_t)nthreads;
+		sweeps[i].rounds = rounds;
+		sweeps[i].ready = &ready;
+		sweeps[i].nthreads = nthreads;
+	}
+
+	// This thread is one of them
+	const uint64_t start = _test_now();
+	while (started < nthreads - 1
+	       && !pthread_create(&threads[started],
+				  NULL,
+				  _test_sweep,
+				  &sweeps[started + 1])) {
+		started++;
+	}
+	if (started < nthreads - 1) {
+		// Whoever did start can't wait for the missing ones
+		__atomic_fetch_add(&ready, nthreads, __ATOMIC_ACQ_REL);
+	}
+	_test_sweep(&sweeps[0]);
+	for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+	const double ns = (double)(_test_now() - start);
+	return (double)(len / (size_t)nthreads * (size_t)(started + 1) * 8
+			* rounds)
+		/ ns;
+}
+
+static void _test_machine_measure(_test_machine_t *machine) {
+	memset(machine, 0, sizeof(*machine));
+	machine->ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (machine->ncpus < 1) machine->ncpus = 1;
+	if (machine->ncpus > 256) machine->ncpus = 256;
+
+	// Half of each cache, and well past the last one for memory. Only
+	// machines short on memory get less than four times the L3, and never
+	// less than twice it.
+	const size_t l3 = _test_cache_size(_SC_LEVEL3_CACHE_SIZE, 8 << 20);
+	const long pages = sysconf(_SC_PHYS_PAGES);
+	const long page = sysconf(_SC_PAGESIZE);
+	const size_t phys = pages > 0 && page > 0
+		? (size_t)pages * (size_t)page
+		: SIZE_MAX;
+	size_t dram = l3 * 4;
+	if (dram < (64 << 20)) dram = 64 << 20;
+	if (dram > phys / 4) dram = phys / 4;
+	if (dram < l3 * 2) dram = l3 * 2;
+	machine->sizes[0] = _test_cache_size(_SC_LEVEL1_DCACHE_SIZE, 32 << 10);
+	machine->sizes[1] = _test_cache_size(_SC_LEVEL2_CACHE_SIZE, 1 << 20);
+	machine->sizes[2] = l3;
+	machine->sizes[3] = dram;
+	uint64_t rng = 0x9E3779B97F4A7C15ULL;
+	for (int i = 0; i < 4; i++) {
+		const size_t bytes = i < 3 ? machine->sizes[i] / 2 : dram;
+		machine->latency[i] = _test_chase(bytes, &rng);
+	}
+
+	const size_t len = dram / sizeof(uint64_t);
+	uint64_t *data = (uint64_t *)malloc(dram);
+	if (data) {
+		for (size_t i = 0; i < len; i++) data[i] = i;
+		machine->bw_single = _test_bandwidth(data, len, 1);
+		machine->bw_all = _test_bandwidth(data, len, machine->ncpus);
+		free(data);
+	}
+
+	const uint64_t start = _test_now();
+	for (int i = 0; i < 1000000; i++) {
+		__asm__ volatile("" : : "r"(_test_now()));
+	}
+	machine->timer_ns = (double)(_test_now() - start) / 1e6;
+	struct timespec res;
+	clock_getres(CLOCK_MONOTONIC, &res);
+	machine->timer_res_ns = (double)res.tv_sec * 1e9 + (double)res.tv_nsec;
+	machine->measured = true;
+}
+
+// Benchmark history, --history[=file]. Every run appends a fixed size record
+// per benchmark, keyed by name, commit and host, and --history-report=html
+// renders the file into a static page with each benchmark's trend and the
+// points where it changed.
+typedef struct _test_history {
+	// Records are written as is, in the machine's byte order
+	char magic[4];
+	uint32_t size;
+	int64_t time_ns;
+	double median, lo, hi, mean;
+	uint64_t iters;
+	char name[96], commit[48], host[64];
+} _test_history_t;
+
+#ifndef TEST_HISTORY_CHANGE
+// Relative change in the median that counts as a change point
+# define TEST_HISTORY_CHANGE 0.05
+#endif
+
+// $TEST_COMMIT, or the checkout's HEAD
+static void _test_commit(char *commit, size_t size) {
+	const char *env = getenv("TEST_COMMIT");
+	if (env) {
+		snprintf(commit, size, "%s", env);
+		return;
+	}
+	commit[0] = '\0';
+	FILE *git = popen("git rev-parse HEAD 2>/dev/null", "r");
+	if (!git) return;
+	if (!fgets(commit, (int)size, git)) commit[0] = '\0';
+	commit[strcspn(commit, "\n")] = '\0';
+	pclose(git);
+}
+
+static inline void _test_history_append(const _test_state_t *state) {
+	FILE *file = fopen(state->history, "ab");
+	if (!file) {
+		fprintf(stderr, "can't append to %s\n", state->history);
+		return;
+	}
+	_test_history_t rec;
+	memset(&rec, 0, sizeof(rec));
+	memcpy(rec.magic, "EKH1", 4);
+	rec.size = sizeof(rec);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	rec.time_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	_test_commit(rec.commit, sizeof(rec.commit));
+	gethostname(rec.host, sizeof(rec.host) - 1);
+	for (int i = 0; i < state->nbenches; i++) {
+		const _test_t *test = state->benches[i];
+		if (test->kind != _TEST_BENCH || test->skip
+		    || !test->measured) {
+			continue;
+		}
+		snprintf(rec.name, sizeof(rec.name), "%s", test->name);
+		rec.median = test->stats.median, rec.mean = test->stats.mean;
+		rec.lo = test->stats.lo, rec.hi = test->stats.hi;
+		rec.iters = test->stats.iters;
+		fwrite(&rec, sizeof(rec), 1, file);
+	}
+	fclose(file);
+}
+
+static int _test_history_cmp(const void *a, const void *b) {
+	const _test_history_t *x = (const _test_history_t *)a;
+	const _test_history_t *y = (const _test_history_t *)b;
+	int cmp = strcmp(x->host, y->host);
+	if (!cmp) cmp = strcmp(x->name, y->name);
+	if (!cmp) cmp = (x->time_ns > y->time_ns) - (x->time_ns < y->time_ns);
+	return cmp;
+}
+
+static double _test_fabs(double x) {
+	return x < 0.0 ? -x : x;
+}
+
+static double _test_window_median(const _test_history_t *recs, size_t n) {
+	double window[64];
+	for (size_t i = 0; i < n; i++) window[i] = recs[i].median;
+	qsort(window, n, sizeof(*window), _test_cmp_double);
+	return n % 2 ? window[n / 2] : (window[n / 2 - 1] + window[n / 2]) / 2;
+}
+
+// Relative change between the medians of the w runs before i and the w runs
+// from i on, or 0 if the two windows overlap
+static double _test_history_shift(
+	const _test_history_t *recs, size_t i, size_t w) {
+	double min[2] = {recs[i - w].median, recs[i].median};
+	double max[2] = {min[0], min[1]};
+	for (size_t j = 0; j < 2 * w; j++) {
+		const double v = recs[i - w + j].median;
+		if (v < min[j >= w]) min[j >= w] = v;
+		if (v > max[j >= w]) max[j >= w] = v;
+	}
+	if (min[1] <= max[0] && min[0] <= max[1]) return 0.0;
+	const double before = _test_window_median(recs + i - w, w);
+	const double after = _test_window_median(recs + i, w);
+	return before > 0.0 ? after / before - 1.0 : 0.0;
+}
+
+// Marks the runs where the benchmark's speed shifted for good: the middle
+// of two windows that don't overlap and whose medians differ by
+// TEST_HISTORY_CHANGE or more, and differ the most of the nearby splits
+static size_t _test_history_changes(
+	const _test_history_t *recs, size_t n, size_t *changes) {
+	size_t w = n / 2 < 5 ? n / 2 : 5, nchanges = 0;
+	if (w < 2) return 0;
+	for (size_t i = w; i + w <= n; i++) {
+		const double shift =
+			_test_fabs(_test_history_shift(recs, i, w));
+		if (shift < TEST_HISTORY_CHANGE) continue;
+		bool peak = true;
+		const size_t from = i + 1 > 2 * w ? i - w + 1 : w;
+		for (size_t j = from; j < i + w && j + w <= n && peak; j++) {
+			peak = j == i
+				|| _test_fabs(_test_history_shift(recs, j, w))
+					<= shift;
+		}
+		if (peak) changes[nchanges++] = i;
+	}
+	return nchanges;
+}
+
+// One benchmark on one host: the median over time with its confidence
+// interval shaded, and change points in red
+static void _test_history_svg(FILE *out,
+			      const _test_history_t *recs,
+			      size_t n,
+			      const size_t *changes,
+			      size_t nchanges) {
+	const double width = 720, height = 160, pad = 40;
+	double lo = recs[0].lo, hi = recs[0].hi;
+	for (size_t i = 0; i < n; i++) {
+		if (recs[i].lo < lo) lo = recs[i].lo;
+		if (recs[i].hi > hi) hi = recs[i].hi;
+	}
+	if (hi <= lo) hi = lo + 1.0;
+	const double scale = (height - 2 * pad) / (hi - lo);
+	double xs[4096], ys[4096];
+	for (size_t i = 0; i < n; i++) {
+		xs[i] = pad + (n > 1 ? (double)i / (double)(n - 1) : 0.5)
+			* (width - 2 * pad);
+		ys[i] = height - pad - (recs[i].median - lo) * scale;
+	}
+	fprintf(out,
+		"<svg width=\"%.0f\" height=\"%.0f\">\n<polygon class=\"ci\" "
+		"points=\"",
+		width,
+		height);
+	for (size_t i = 0; i < n; i++) {
+		fprintf(out,
+			"%.1f,%.1f ",
+			xs[i],
+			height - pad - (recs[i].hi - lo) * scale);
+	}
+	for (size_t i = n; i--;) {
+		fprintf(out,
+			"%.1f,%.1f ",
+			xs[i],
+			height - pad - (recs[i].lo - lo) * scale);
+	}
+	fprintf(out, "\"/>\n<polyline points=\"");
+	for (size_t i = 0; i < n; i++) fprintf(out, "%.1f,%.1f ", xs[i], ys[i]);
+	fprintf(out, "\"/>\n");
+	for (size_t i = 0; i < nchanges; i++) {
+		const double x = (xs[changes[i] - 1] + xs[changes[i]]) / 2;
+		fprintf(out,
+			"<line class=\"change\" x1=\"%.1f\" y1=\"%.0f\" "
+			"x2=\"%.1f\" y2=\"%.0f\"/>\n",
+			x,
+			pad / 2,
+			x,
+			height - pad / 2);
+	}
+	for (size_t i = 0; i < n; i++) {
+		char date[32];
+		const time_t t = (time_t)(recs[i].time_ns / 1000000000);
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&t));
+		fprintf(out,
+			"<circle cx=\"%.1f\" cy=\"%.1f\" r=\"3\">"
+			"<title>%s %.12s %.2fns</title></circle>\n",
+			xs[i],
+			ys[i],
+			date,
+			recs[i].commit,
+			recs[i].median);
+	}
+	fprintf(out,
+		"<text x=\"2\" y=\"%.0f\">%.2fns</text><text x=\"2\" "
+		"y=\"%.0f\">%.2fns</text>\n</svg>\n",
+		pad,
+		hi,
+		height - pad,
+		lo);
+}
+
+static inline int _test_history_report(const _test_state_t *state) {
+	size_t size;
+	uint8_t *data = _test_read_file(state->history, &size);
+	if (!data) {
+		fprintf(stderr, "can't read %s\n", state->history);
+		return 2;
+	}
+	// Counts the records first, they can be shorter than ours
+	size_t n = 0, count = 0;
+	for (size_t off = 0; off + 8 <= size; count++) {
+		uint32_t recsize;
+		memcpy(&recsize, data + off + 4, 4);
+		if (memcmp(data + off, "EKH1", 4) || recsize < 8
+		    || recsize > size - off) {
+			break;
+		}
+		off += recsize;
+	}
+	_test_history_t *recs = (_test_history_t *)malloc(
+		(count ? count : 1) * sizeof(*recs));
+	for (size_t off = 0; recs && n < count;) {
+		uint32_t recsize;
+		memcpy(&recsize, data + off + 4, 4);
+		memset(&recs[n], 0, sizeof(recs[n]));
+		memcpy(&recs[n++],
+		       data + off,
+		       recsize < sizeof(*recs) ? recsize : sizeof(*recs));
+		recs[n - 1].name[sizeof(recs->name) - 1] = '\0';
+		recs[n - 1].commit[sizeof(recs->commit) - 1] = '\0';
+		recs[n - 1].host[sizeof(recs->host) - 1] = '\0';
+		off += recsize;
+	}
+	free(data);
+	FILE *out = fopen(state->history_report, "w");
+	if (!recs || !out) {
+		free(recs);
+		if (out) fclose(out);
+		fprintf(stderr, "can't write %s\n", state->history_report);
+		return 2;
+	}
+	qsort(recs, n, sizeof(*recs), _test_history_cmp);
+
+	fprintf(out,
+		"<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\">"
+		"<title>benchmark history</title>\n<style>\n"
+		"body { font-family: sans-serif; margin: 2em; }\n"
+		"td, th { padding: 2px 12px; text-align: right; }\n"
+		"td:first-child, th:first-child { text-align: left; }\n"
+		"svg text { font-size: 11px; fill: #666; }\n"
+		"polyline { fill: none; stroke: #2266aa; stroke-width: 1.5; }\n"
+		"polygon.ci { fill: #2266aa; opacity: 0.15; }\n"
+		"circle { fill: #2266aa; }\n"
+		"line.change { stroke: #cc2222; stroke-dasharray: 4 3; }\n"
+		".slower { color: #cc2222; } .faster { color: #228822; }\n"
+		"</style></head><body>\n<h1>");
+	_test_xml(out, state->progname);
+	fprintf(out,
+		" benchmark history</h1>\n<table>\n<tr><th>benchmark</th>"
+		"<th>host</th><th>runs</th><th>latest</th><th>since "
+		"first runs</th><th>change points</th></tr>\n");
+
+	// Summary table first, then a chart per series
+	for (int charts = 0; charts < 2; charts++) {
+		for (size_t start = 0, end; start < n; start = end) {
+			for (end = start + 1; end < n
+			     && !strcmp(recs[end].host, recs[start].host)
+			     && !strcmp(recs[end].name, recs[start].name);
+			     end++) {
+			}
+			// The latest runs, past 4096 of them
+			const size_t len = end - start < 4096 ? end - start
+							      : 4096;
+			const _test_history_t *series = recs + end - len;
+			size_t changes[4096];
+			const size_t nchanges =
+				_test_history_changes(series, len, changes);
+			if (charts) {
+				fprintf(out, "<h2 id=\"s%zu\">", start);
+				_test_xml(out, series->name);
+				fprintf(out, " <small>on ");
+				_test_xml(out, series->host);
+				fprintf(out, "</small></h2>\n");
+				_test_history_svg(
+					out, series, len, changes, nchanges);
+				continue;
+			}
+			// Between the first and last few runs
+			const size_t w = len / 2 < 5 ? (len + 1) / 2 : 5;
+			const double first = _test_window_median(series, w);
+			const double change = first > 0.0
+				? _test_window_median(series + len - w, w)
+						/ first
+					- 1.0
+				: 0.0;
+			fprintf(out, "<tr><td><a href=\"#s%zu\">", start);
+			_test_xml(out, series->name);
+			fprintf(out, "</a></td><td>");
+			_test_xml(out, series->host);
+			fprintf(out,
+				"</td><td>%zu</td><td>%.2fns</td><td "
+				"class=\"%s\">%+.1f%%</td><td>",
+				end - start,
+				series[len - 1].median,
+				change > TEST_HISTORY_CHANGE	? "slower"
+				: change < -TEST_HISTORY_CHANGE ? "faster"
+								: "",
+				change * 100.0);
+			for (size_t i = 0; i < nchanges; i++) {
+				const double shift = _test_history_shift(
+					series,
+					changes[i],
+					len / 2 < 5 ? len / 2 : 5);
+				fprintf(out,
+					"%s<span class=\"%s\">%+.1f%%</span> "
+					"at %.12s",
+					i ? ", " : "",
+					shift > 0 ? "slower" : "faster",
+					shift * 100.0,
+					series[changes[i]].commit);
+			}
+			fprintf(out, "</td></tr>\n");
+		}
+		if (!charts) fprintf(out, "</table>\n");
+	}
+	fprintf(out, "</body></html>\n");
+	fclose(out);
+	printf("Wrote %zu runs to %s\n", n, state->history_report);
+	free(recs);
+	return 0;
+}
+
+static void _test_run_group(_test_t *group) {
+	_test_t *members[64];
+	const int n = _test_group_members(group, members, true);
+	if (!n) return;
+	_test_bench_measure_all(members, n);
+	_test_report(group, group, members, n);
+}
+
+// Table-driven tests. Every case runs on its own, in parallel on --jobs
+// threads (one per cpu by default) for test_on_parallel. The table is one
+// result, failing when any case does, with the failing cases listed as
+// [index] in its message.
+typedef struct _test_case_run {
+	_test_t *test;
+	size_t next;
+	int *lines;
+	char **msgs;
+
+	// Most any case held in its thread's arena
+	size_t peak;
+} _test_case_run_t;
+
+static void *_test_case_thread(void *arg) {
+	_test_case_run_t *run = (_test_case_run_t *)arg;
+	const _test_cases_t *cases = &run->test->cases;
+	size_t peak = 0;
+	for (;;) {
+		const size_t i =
+			__atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+		if (i >= cases->nitems) break;
+		_test_msglen = 0, _test_msg[0] = '\0';
+		run->lines[i] = cases->fn(
+			(void *)((uintptr_t)cases->array + i * cases->step));
+		const size_t used = _test_arena_rewind(0);
+		if (used > peak) peak = used;
+		if (run->lines[i]) run->msgs[i] = strdup(_test_msg);
+	}
+	size_t seen = __atomic_load_n(&run->peak, __ATOMIC_RELAXED);
+	while (peak > seen
+	       && !__atomic_compare_exchange_n(&run->peak,
+					       &seen,
+					       peak,
+					       true,
+					       __ATOMIC_RELAXED,
+					       __ATOMIC_RELAXED)) {}
+	return NULL;
+}
+
+static bool _test_run_cases(_test_t *test, _test_state_t *state) {
+	const size_t n = test->cases.nitems;
+	_test_case_run_t run = {test, 0, NULL, NULL, 0};
+	run.lines = (int *)calloc(n ? n : 1, sizeof(*run.lines));
+	run.msgs = (char **)calloc(n ? n : 1, sizeof(*run.msgs));
+	int nthreads = 1;
+	if (test->cases.parallel) {
+		nthreads = state->jobs ? state->jobs
+				       : (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads > 64) nthreads = 64;
+		if ((size_t)nthreads > n) nthreads = (int)n;
+	}
+
+	state->current = test;
+	const uint64_t start = _test_now();
+	pthread_t threads[64];
+	int started = 0;
+	while (run.lines && run.msgs && started < nthreads - 1
+	       && !pthread_create(
+		       &threads[started], NULL, _test_case_thread, &run)) {
+		started++;
+	}
+	if (run.lines && run.msgs) _test_case_thread(&run);
+	for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+	const double secs = (double)(_test_now() - start) / 1e9;
+	state->current = NULL;
+
+	// The first failing case's line, and as many of their messages as fit
+	size_t failed = 0;
+	int line = 0;
+	for (size_t i = 0; run.lines && run.msgs && i < n; i++) {
+		if (run.lines[i] && !failed++) line = run.lines[i];
+	}
+	_test_msglen = 0, _test_msg[0] = '\0';
+	if (failed) _test_msgf("%zu of %zu cases failed", failed, n);
+	for (size_t i = 0; run.lines && run.msgs && i < n; i++) {
+		if (!run.lines[i]) continue;
+		_test_msgf("; [%zu] on line %d", i, run.lines[i]);
+		if (run.msgs[i] && *run.msgs[i]) {
+			_test_msgf(": %s", run.msgs[i]);
+		}
+		free(run.msgs[i]);
+	}
+	if (!run.lines || !run.msgs) {
+		line = __LINE__, failed = 1;
+		_test_msgf("out of memory");
+	}
+	const _test_result_t result = {test, line, _test_msg, secs};
+	test->arena_peak = run.peak;
+	_test_report(result, &result);
+	state->ran++, state->passed += !failed;
+	test->cached = true, test->failed = failed != 0, test->secs = secs;
+	free(run.lines);
+	free(run.msgs);
+	return !failed;
+}
+
+// Fork servers for fixtures. Each fixture gets a child that runs its body
+// once and then forks again for every test sent to it, waiting for the fork
+// before taking the next one. Tests are sent as pointers, which stay valid as
+// the server is a fork of this process. Results come back through memory
+// shared with the server and its forks, so a test crashing only loses its own
+// fork.
+typedef struct _test_fork_result {
+	int line;
+	double secs;
+	size_t arena_peak;
+	char msg[1024];
+} _test_fork_result_t;
+
+typedef struct _test_server {
+	_test_t *fixture;
+	_test_fork_result_t *result;
+	pid_t pid;
+	int to, from;
+
+	// Where the fixture failed, or -1 if its server died
+	int line;
+} _test_server_t;
+
+static _test_server_t _test_servers[64];
+static int _test_nservers;
+
+static void _test_serve(_test_server_t *server, int in, int out) {
+	_test_fork_result_t *result = server->result;
+	const int sigs[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+	for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+		signal(sigs[i], SIG_DFL);
+	}
+	_test_state->current = NULL;
+	_test_msglen = 0, _test_msg[0] = '\0';
+	const int line = server->fixture->testfn();
+	memcpy(result->msg, _test_msg, sizeof(result->msg));
+	fflush(NULL);
+	if (write(out, &line, sizeof(line)) != sizeof(line) || line) _exit(0);
+
+	// Whatever the fixture put in the arena is part of the snapshot
+	const size_t mark = _test_arena.used;
+	_test_t *test;
+	while (read(in, &test, sizeof(test)) == sizeof(test)) {
+		const pid_t pid = fork();
+		if (!pid) {
+			_test_msglen = 0, _test_msg[0] = '\0';
+			const uint64_t start = _test_now();
+			result->line = test->testfn();
+			result->secs = (double)(_test_now() - start) / 1e9;
+			result->arena_peak = _test_arena_rewind(mark);
+			memcpy(result->msg, _test_msg, sizeof(result->msg));
+			fflush(NULL);
+			_exit(0);
+		}
+		int status = -1;
+		if (pid < 0 || waitpid(pid, &status, 0) < 0) status = -1;
+		if (write(out, &status, sizeof(status)) != sizeof(status)) {
+			break;
+		}
+	}
+	_exit(0);
+}
+
+// Finds the fixture's server, starting it (and running the fixture) the
+// first time it's needed
+static _test_server_t *_test_server(_test_state_t *state, const char *name) {
+	for (int i = 0; i < _test_nservers; i++) {
+		if (!strcmp(_test_servers[i].fixture->name, name)) {
+			return &_test_servers[i];
+		}
+	}
+	_test_t *fixture = NULL;
+	for (int i = 0; i < state->nfixtures; i++) {
+		if (!strcmp(state->fixtures[i]->name, name)) {
+			fixture = state->fixtures[i];
+		}
+	}
+	if (!fixture || _test_nservers == 64) return NULL;
+
+	_test_server_t *server = &_test_servers[_test_nservers];
+	void *shared = mmap(NULL,
+			    sizeof(_test_fork_result_t),
+			    PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_ANONYMOUS,
+			    -1,
+			    0);
+	int to[2] = {-1, -1}, from[2] = {-1, -1};
+	if (shared == MAP_FAILED) return NULL;
+	if (pipe(to) || pipe(from)) {
+		close(to[0]), close(to[1]);
+		munmap(shared, sizeof(_test_fork_result_t));
+		return NULL;
+	}
+	memset(server, 0, sizeof(*server));
+	server->fixture = fixture;
+	server->result = (_test_fork_result_t *)shared;
+	server->to = to[1], server->from = from[0], server->line = -1;
+	_test_nservers++;
+	fflush(NULL);
+	server->pid = fork();
+	if (!server->pid) {
+		close(to[1]), close(from[0]);
+		_test_serve(server, to[0], from[1]);
+	}
+	close(to[0]), close(from[1]);
+	if (server->pid < 0
+	    || read(server->from, &server->line, sizeof(server->line))
+		       != sizeof(server->line)) {
+		server->line = -1;
+	}
+	return server;
+}
+
+// Runs a test_in test in a fork of its fixture's server and leaves the
+// failure message in _test_msg
+static int _test_run_forked(_test_t *test, _test_state_t *state) {
+	_test_server_t *server = _test_server(state, test->fixture);
+	if (!server) {
+		_test_msgf("no fixture named %s", test->fixture);
+		return __LINE__;
+	}
+	_test_fork_result_t *result = server->result;
+	if (server->line) {
+		if (server->line < 0) {
+			_test_msgf("fixture %s crashed", test->fixture);
+		} else {
+			_test_msgf("fixture %s failed on line %d: %s",
+				     test->fixture,
+				     server->line,
+				     result->msg);
+		}
+		return __LINE__;
+	}
+
+	memset(result, 0, sizeof(*result));
+	int status;
+	if (write(server->to, &test, sizeof(test)) != sizeof(test)
+	    || read(server->from, &status, sizeof(status)) != sizeof(status)) {
+		server->line = -1;
+		_test_msgf("fixture %s crashed", test->fixture);
+		return __LINE__;
+	}
+	if (status == -1 || !WIFEXITED(status)) {
+		_test_msgf("crashed with signal %d",
+			     WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+		return __LINE__;
+	}
+	_test_msgf("%s", result->msg);
+
+	// So the arena peak reported is the fork's
+	_test_arena.peak = result->arena_peak;
+	return result->line;
+}
+
+static inline void _test_servers_stop(void) {
+	for (int i = 0; i < _test_nservers; i++) {
+		close(_test_servers[i].to), close(_test_servers[i].from);
+		if (_test_servers[i].pid > 0) {
+			waitpid(_test_servers[i].pid, NULL, 0);
+		}
+		munmap(_test_servers[i].result, sizeof(_test_fork_result_t));
+	}
+	_test_nservers = 0;
+}
+
+static inline bool _test_run(_test_t *test, _test_state_t *state) {
+	if (test->kind == _TEST_CASES) return _test_run_cases(test, state);
+	_test_msglen = 0, _test_msg[0] = '\0';
+	state->current = test;
+	const uint64_t start = _test_now();
+	const int fail_line = test->kind == _TEST_FUZZ ? _test_fuzz_replay(test)
+		: test->fixture ? _test_run_forked(test, state)
+		: test->call    ? test->call(test)
+				: test->testfn();
+	const _test_result_t result = {
+		test,
+		fail_line,
+		_test_msg,
+		(double)(_test_now() - start) / 1e9,
+	};
+	test->arena_peak = _test_arena_rewind(0);
+	state->current = NULL;
+	test->cached = true, test->failed = fail_line != 0;
+	test->secs = result.secs;
+	_test_report(result, &result);
+	state->passed += !fail_line, state->ran++;
+	return !fail_line;
+}
+
+static void _test_start(_test_state_t *state, const char *progname) {
+	memset(state, 0, sizeof(*state));
+	_test_state = state;
+	const char *base = strrchr(progname, '/');
+	state->progname = base ? base + 1 : progname;
+	state->start = _test_now();
+	state->fuzz_time = 60.0;
+	state->stress_time = 10.0;
+	state->max_len = 4096;
+	state->worker = -1;
+	state->seed = state->start;
+	static char cache[256];
+	snprintf(cache, sizeof(cache), ".%s.testcache", state->progname);
+	state->cache = cache;
+
+#ifndef TEST_LIBFUZZER
+	const int sigs[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+	for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+		signal(sigs[i], _test_crash);
+	}
+#endif
+}
+
+static inline int _test_end(_test_state_t *state) {
+	// Benchmarks would only slow down rerunning the failures
+	if (state->only_failed) state->nbenches = 0;
+	_test_perf_names(state);
+	if (state->characterize) {
+		_test_machine_measure(&state->machine);
+		_test_report(machine, &state->machine);
+	}
+
+	// Run benchmarks if there is any. Group members are measured together
+	// first so they don't get measured on their own, and with --shuffle
+	// everything is.
+	if (state->shuffle) {
+		_test_t *all[1024];
+		int n = 0;
+		for (int i = 0; i < state->nbenches; i++) {
+			if (state->benches[i]->kind != _TEST_BENCH) continue;
+			all[n++] = state->benches[i];
+		}
+		_test_bench_measure_all(all, n);
+	}
+	for (int i = 0; i < state->nbenches; i++) {
+		if (state->benches[i]->kind != _TEST_GROUP) continue;
+		_test_t *members[64];
+		const int n =
+			_test_group_members(state->benches[i], members, false);
+		_test_bench_measure_all(members, n);
+	}
+	for (int i = 0; i < state->nbenches; i++) {
+		_test_t *test = state->benches[i];
+		state->current = test;
+		if (test->kind == _TEST_GROUP) {
+			_test_run_group(test);
+		} else {
+			_test_bench_measure(test);
+			_test_report(bench, test);
+		}
+		state->current = NULL;
+	}
+	if (state->history) _test_history_append(state);
+	if (state->profile) {
+		mkdir(state->profile, 0755);
+		for (int i = 0; i < state->nbenches; i++) {
+			_test_prof_write(state->profile, state->benches[i]);
+		}
+		if (_test_prof.dropped) {
+			fprintf(stderr,
+				"profile buffer full, dropped %zu samples\n",
+				_test_prof.dropped);
+		}
+	}
+
+	_test_report(end, state);
+	for (int i = 0; i < state->nreporters; i++) {
+		if (state->reporters[i].out == stdout) fflush(stdout);
+		else fclose(state->reporters[i].out);
+	}
+	return state->passed == state->ran ? 0 : 1;
+}
+
+// Registers a copy of the batch benchmark named name/size for each of its
+// chunk sizes
+static void _test_add_batch(_test_state_t *state, _test_t *test) {
+	const size_t *chunks = test->bench.chunks;
+	const char *base = test->name;
+	for (size_t i = 0; chunks[i] && state->nbenches < 1024; i++) {
+		_test_t *copy = i ? (_test_t *)malloc(sizeof(_test_t)) : test;
+		char *name;
+		if (!copy || asprintf(&name, "%s/%zu", base, chunks[i]) < 0) {
+			break;
+		}
+		if (i) *copy = *test;
+		copy->name = name;
+		copy->bench.chunk = chunks[i];
+		state->benches[state->nbenches++] = copy;
+	}
+}
+
+// bench_file benchmarks are registered as name/cold and name/warm
+static void _test_add_file(_test_state_t *state, _test_t *test) {
+	_test_t *warm = (_test_t *)malloc(sizeof(_test_t));
+	char *cold_name, *warm_name;
+	if (!warm || state->nbenches > 1022
+	    || asprintf(&cold_name, "%s/cold", test->name) < 0) {
+		free(warm);
+		return;
+	}
+	if (asprintf(&warm_name, "%s/warm", test->name) < 0) {
+		free(warm), free(cold_name);
+		return;
+	}
+	*warm = *test;
+	test->name = cold_name, test->bench.cold = true;
+	warm->name = warm_name;
+	state->benches[state->nbenches++] = test;
+	state->benches[state->nbenches++] = warm;
+}
+
+// Only collects the tests and benchmarks, they are run once all of them are
+// known so tests can refer to benchmarks declared after them
+static void _test_add(_test_state_t *state, _test_t *test) {
+	if (test->kind == _TEST_TEST || test->kind == _TEST_FUZZ
+	    || test->kind == _TEST_CASES) {
+		if (state->ntests < 1024) state->tests[state->ntests++] = test;
+	} else if (test->kind == _TEST_FIXTURE) {
+		if (state->nfixtures < 64) {
+			state->fixtures[state->nfixtures++] = test;
+		}
+	} else if (test->kind == _TEST_BENCH && test->bench.chunks) {
+		_test_add_batch(state, test);
+	} else if (test->kind == _TEST_BENCH && test->bench.filesize) {
+		_test_add_file(state, test);
+	} else if (state->nbenches < 1024) {
+		state->benches[state->nbenches++] = test;
+	}
+}
+
+#define _test_tryrun(_test)                                                    \
+	if (!_test.name) return;                                               \
+	_test_add(state, &_test)
+
+static void _tests_run_tests(_test_state_t *state);
+
+static _test_t *_test_find_fuzz(_test_state_t *state, const char *name) {
+	for (int i = 0; i < state->ntests; i++) {
+		_test_t *test = state->tests[i];
+		if (test->kind != _TEST_FUZZ) continue;
+		if (!name || !strcmp(test->name, name)) return test;
+	}
+	fprintf(stderr, "no fuzz target named %s\n", name ? name : "");
+	return NULL;
+}
+
+#ifdef __cplusplus
+// C++ API, for use at namespace scope:
+//   static auto &sum = ektest::bench("sum", [] { ... }, 1000);
+// Every body type gets its own copy of the timing loop, so the body inlines
+// into it instead of being called through a pointer.
+namespace ektest {
+
+// Keeps the compiler from optimizing away a value the body computes
+template <class T> inline void keep(const T &value) {
+	__asm__ volatile("" : : "r,m"(value) : "memory");
+}
+
+namespace detail {
+
+inline _test_t &add(const char *name, _test_kind_t kind) {
+	_test_t *test = new _test_t();
+	test->name = name;
+	test->kind = kind;
+	const _test_registrar registrar(test);
+	(void)registrar;
+	return *test;
+}
+
+inline _test_t &add_bench(const char *name, size_t times,
+			  uint64_t (*sample)(_test_bench_t *, size_t),
+			  void *ctx) {
+	_test_t &test = add(name, _TEST_BENCH);
+	test.bench.nitems = 1;
+	test.bench.iters = times;
+	test.bench.sample = sample;
+	test.bench.ctx = ctx;
+	return test;
+}
+
+template <class Body> uint64_t loop(_test_bench_t *bench, size_t iters) {
+	Body &body = *static_cast<Body *>(bench->ctx);
+	const uint64_t start = _test_now();
+	for (size_t i = 0; i < iters; i++) body();
+	return _test_now() - start;
+}
+
+template <class Range, class Body> struct over {
+	Range *range;
+	Body body;
+};
+
+template <class Range, class Body>
+uint64_t loop_over(_test_bench_t *bench, size_t iters) {
+	over<Range, Body> &ctx = *static_cast<over<Range, Body> *>(bench->ctx);
+	const uint64_t start = _test_now();
+	for (size_t i = 0; i < iters; i++) {
+		for (auto &&item : *ctx.range) ctx.body(item);
+	}
+	return _test_now() - start;
+}
+
+// Ranges can be filled in at runtime, so they're counted right before the
+// benchmark runs
+template <class Range, class Body> bool count(_test_t *test) {
+	const over<Range, Body> &ctx =
+		*static_cast<over<Range, Body> *>(test->bench.ctx);
+	test->bench.nitems = (size_t)std::distance(std::begin(*ctx.range),
+						   std::end(*ctx.range));
+	if (test->bench.nitems) return true;
+	test->skip = "empty range";
+	return false;
+}
+
+template <class Fixture, class Body>
+uint64_t loop_with(_test_bench_t *bench, size_t iters) {
+	Body &body = *static_cast<Body *>(bench->ctx);
+	Fixture &fixture = *static_cast<Fixture *>(bench->array);
+	const uint64_t start = _test_now();
+	for (size_t i = 0; i < iters; i++) body(fixture);
+	return _test_now() - start;
+}
+
+// Fixtures live for the whole benchmark, they aren't part of the timing
+template <class Fixture> bool setup(_test_t *test) {
+	test->bench.array = new Fixture();
+	return true;
+}
+
+template <class Fixture> void teardown(_test_t *test) {
+	delete static_cast<Fixture *>(test->bench.array);
+	test->bench.array = nullptr;
+}
+
+template <class Body> int call(_test_t *test) {
+	return (*static_cast<Body *>(test->ctx))();
+}
+
+template <class Fixture, class Body> int call_with(_test_t *test) {
+	Fixture fixture;
+	return (*static_cast<Body *>(test->ctx))(fixture);
+}
+
+} // namespace detail
+
+// Times body()
+template <class Body>
+_test_t &bench(const char *name, Body body, size_t times = 1000) {
+	return detail::add_bench(
+		name, times, detail::loop<Body>, new Body(body));
+}
+
+// Times body(item) for every item in range, like bench_on
+template <class Range,
+	  class Body,
+	  class = decltype(std::begin(std::declval<Range &>()))>
+_test_t &bench(const char *name, Range &range, Body body, size_t times = 1000) {
+	typedef detail::over<Range, Body> ctx_t;
+	_test_t &test = detail::add_bench(name,
+					  times,
+					  detail::loop_over<Range, Body>,
+					  new ctx_t{&range, body});
+	test.bench.prepare = detail::count<Range, Body>;
+	return test;
+}
+
+// Times body(fixture) on a Fixture constructed before the benchmark runs and
+// destroyed after
+template <class Fixture, class Body>
+_test_t &bench(const char *name, Body body, size_t times = 1000) {
+	_test_t &test = detail::add_bench(name,
+					  times,
+					  detail::loop_with<Fixture, Body>,
+					  new Body(body));
+	test.bench.prepare = detail::setup<Fixture>;
+	test.bench.release = detail::teardown<Fixture>;
+	return test;
+}
+
+// A test, body() uses assert, pass and fail like the test macro's body
+template <class Body> _test_t &test_case(const char *name, Body body) {
+	_test_t &test = detail::add(name, _TEST_TEST);
+	test.call = detail::call<Body>;
+	test.ctx = new Body(body);
+	return test;
+}
+
+// A test run as body(fixture) on a fresh Fixture
+template <class Fixture, class Body>
+_test_t &test_case(const char *name, Body body) {
+	_test_t &test = detail::add(name, _TEST_TEST);
+	test.call = detail::call_with<Fixture, Body>;
+	test.ctx = new Body(body);
+	return test;
+}
+
+} // namespace ektest
+#endif
+
+#ifdef TEST_LIBFUZZER
+// Built with -fsanitize=fuzzer, libFuzzer owns main and calls this. The target
+// is the one named by $TEST_FUZZ or else the first one.
+_TEST_C int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static _test_state_t state;
+	static _test_t *target;
+	if (!target) {
+		_test_start(&state, "libfuzzer");
+		_tests_run_tests(&state);
+		if (!(target = _test_find_fuzz(&state, getenv("TEST_FUZZ")))) {
+			abort();
+		}
+	}
+	_test_msglen = 0, _test_msg[0] = '\0';
+	const int fail_line = target->fuzzfn(data, size);
+	_test_arena_rewind(0);
+	if (!fail_line) return 0;
+	fprintf(stderr,
+		"%s failed on line %d: %s\n",
+		target->name,
+		fail_line,
+		_test_msg);
+	abort();
+}
+#else
+int main(int argc, char **argv) {
+	_test_state_t state;
+	_test_start(&state, argv[0]);
+	if (!_test_parse_args(&state, argc, argv)) return 2;
+	_tests_run_tests(&state);
+	if (state.fuzz) {
+		_test_t *target = _test_find_fuzz(&state, state.fuzz);
+		return target ? _test_fuzz(&state, target) : 2;
+	}
+	if (state.stress) return _test_stress(&state);
+	if (state.history_report) return _test_history_report(&state);
+	if (state.worker >= 0) return _test_work(&state);
+	if (state.compare) return _test_compare(&state);
+	if (state.layouts) return _test_layouts(&state);
+	_test_cache_load(&state);
+	state.nrun = _test_cache_order(&state);
+	_test_report(start, &state);
+	for (int i = 0; i < state.nrun; i++) {
+		_test_run(state.tests[i], &state);
+	}
+	_test_servers_stop();
+	_test_cache_save(&state);
+	return _test_end(&state);
+}
+#endif
+
+#ifdef __cplusplus
+static void _tests_run_tests(_test_state_t *state) {
+	for (int i = 0; i < _test_nregistered; i++) {
+		_test_add(state, _test_registry[i]);
+	}
+}
+#else
 _test_t _test0, _test1, _test2, _test3, _test4, _test5, _test6, _test7, _test8,
 	_test9, _test10, _test11, _test12, _test13, _test14, _test15, _test16,
 	_test17, _test18, _test19, _test20, _test21, _test22, _test23, _test24,
@@ -1355,3 +6164,4 @@ static void _tests_run_tests(_test_state_t *state) {
 	_test_tryrun(_test1022);
 	_test_tryrun(_test1023);
 }
+#endif